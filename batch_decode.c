@@ -0,0 +1,226 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * memory data batch decode
+ * frames holds count memory data responses back to back, MEMDATA_RECORD_LEN
+ * bytes apart. Every field is read into its column of struct sensor_batch.
+ *
+ * Besides the scalar loop there are vector versions that take four records
+ * at a time: each record is loaded as two 16 byte vectors, widened to four
+ * 32 bit fields and the 4x4 blocks are transposed into the columns.
+ * SSSE3 is picked at runtime on x86, NEON when the build targets it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BATCH_SSSE3
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BATCH_NEON
+#endif
+
+#include "common.h"
+#include "batch_decode.h"
+
+typedef void (*batch_decode_fn)(struct sensor_batch *b, const uint8_t *frames, uint32_t count);
+
+static batch_decode_fn decode_fn;
+static const char *decode_name;
+
+/*
+ * time counter of record frame, in msec
+ */
+static inline uint64_t record_time_ms(const uint8_t *frame) {
+	const uint8_t *t = frame + MEMDATA_TIME_OFFSET;
+
+	return ((uint64_t)(t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32_t)t[3] << 24)) |
+		(uint64_t)(t[4] | (t[5] << 8) | (t[6] << 16) | ((uint32_t)t[7] << 24)) << 32) * 1000;
+}
+
+/*
+ * one record, scalar
+ */
+static inline void decode_one(struct sensor_batch *b, const uint8_t *frame, uint32_t i) {
+	const uint8_t *d = frame + MEMDATA_DATA_OFFSET;
+
+	b->time_ms[i] = record_time_ms(frame);
+	b->temp[i] = d[0] | (d[1] << 8);
+	b->humid[i] = d[2] | (d[3] << 8);
+	b->light[i] = d[4] | (d[5] << 8);
+	b->press[i] = (int32_t)(d[6] | (d[7] << 8) | (d[8] << 16) | ((uint32_t)d[9] << 24));
+	b->noise[i] = d[10] | (d[11] << 8);
+	b->TVOC[i] = d[12] | (d[13] << 8);
+	b->CO2[i] = d[14] | (d[15] << 8);
+	b->discom[i] = d[16] | (d[17] << 8);
+	b->heat[i] = d[18] | (d[19] << 8);
+}
+
+/*
+ * scalar decode
+ */
+void sensor_batch_decode_scalar(struct sensor_batch *b, const uint8_t *frames, uint32_t count) {
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		decode_one(b, frames + i * MEMDATA_RECORD_LEN, i);
+	}
+	b->count = count;
+}
+
+#ifdef BATCH_SSSE3
+/*
+ * SSSE3 decode
+ * lo = data[0..15] shuffled to temp, humid, light, press
+ * hi = data[4..19] shuffled to noise, TVOC, CO2, discom; heat stays scalar
+ */
+__attribute__((target("ssse3")))
+static void batch_decode_ssse3(struct sensor_batch *b, const uint8_t *frames, uint32_t count) {
+	const __m128i lo_mask = _mm_setr_epi8(0, 1, -1, -1, 2, 3, -1, -1,
+					      4, 5, -1, -1, 6, 7, 8, 9);
+	const __m128i hi_mask = _mm_setr_epi8(6, 7, -1, -1, 8, 9, -1, -1,
+					      10, 11, -1, -1, 12, 13, -1, -1);
+	__m128i lo[4], hi[4], t0, t1, t2, t3;
+	const uint8_t *f, *d;
+	uint32_t i;
+	int k;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		for (k = 0; k < 4; k++) {
+			f = frames + (i + k) * MEMDATA_RECORD_LEN;
+			d = f + MEMDATA_DATA_OFFSET;
+			lo[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)d), lo_mask);
+			hi[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(d + 4)), hi_mask);
+			b->time_ms[i + k] = record_time_ms(f);
+			b->heat[i + k] = d[18] | (d[19] << 8);
+		}
+
+		t0 = _mm_unpacklo_epi32(lo[0], lo[1]);
+		t1 = _mm_unpacklo_epi32(lo[2], lo[3]);
+		t2 = _mm_unpackhi_epi32(lo[0], lo[1]);
+		t3 = _mm_unpackhi_epi32(lo[2], lo[3]);
+		_mm_storeu_si128((__m128i *)&b->temp[i], _mm_unpacklo_epi64(t0, t1));
+		_mm_storeu_si128((__m128i *)&b->humid[i], _mm_unpackhi_epi64(t0, t1));
+		_mm_storeu_si128((__m128i *)&b->light[i], _mm_unpacklo_epi64(t2, t3));
+		_mm_storeu_si128((__m128i *)&b->press[i], _mm_unpackhi_epi64(t2, t3));
+
+		t0 = _mm_unpacklo_epi32(hi[0], hi[1]);
+		t1 = _mm_unpacklo_epi32(hi[2], hi[3]);
+		t2 = _mm_unpackhi_epi32(hi[0], hi[1]);
+		t3 = _mm_unpackhi_epi32(hi[2], hi[3]);
+		_mm_storeu_si128((__m128i *)&b->noise[i], _mm_unpacklo_epi64(t0, t1));
+		_mm_storeu_si128((__m128i *)&b->TVOC[i], _mm_unpackhi_epi64(t0, t1));
+		_mm_storeu_si128((__m128i *)&b->CO2[i], _mm_unpacklo_epi64(t2, t3));
+		_mm_storeu_si128((__m128i *)&b->discom[i], _mm_unpackhi_epi64(t2, t3));
+	}
+	for (; i < count; i++) {
+		decode_one(b, frames + i * MEMDATA_RECORD_LEN, i);
+	}
+	b->count = count;
+}
+#endif
+
+#ifdef BATCH_NEON
+/*
+ * 4x4 transpose, rows r[0..3] to the four columns
+ */
+static inline void store_columns(uint32x4_t *r, int32_t *c0, int32_t *c1, int32_t *c2, int32_t *c3) {
+	uint32x4x2_t t01 = vtrnq_u32(r[0], r[1]);
+	uint32x4x2_t t23 = vtrnq_u32(r[2], r[3]);
+
+	vst1q_s32(c0, vreinterpretq_s32_u32(vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]))));
+	vst1q_s32(c1, vreinterpretq_s32_u32(vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]))));
+	vst1q_s32(c2, vreinterpretq_s32_u32(vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]))));
+	vst1q_s32(c3, vreinterpretq_s32_u32(vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]))));
+}
+
+/*
+ * NEON decode
+ * lo = data[0..15] widened to temp, humid, light, press (lane 3 patched
+ * with the 32 bit value), hi = data[4..19] widened to TVOC, CO2, discom,
+ * heat; noise stays scalar
+ */
+static void batch_decode_neon(struct sensor_batch *b, const uint8_t *frames, uint32_t count) {
+	uint32x4_t lo[4], hi[4];
+	uint32_t press;
+	const uint8_t *f, *d;
+	uint32_t i;
+	int k;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		for (k = 0; k < 4; k++) {
+			f = frames + (i + k) * MEMDATA_RECORD_LEN;
+			d = f + MEMDATA_DATA_OFFSET;
+			press = d[6] | (d[7] << 8) | (d[8] << 16) | ((uint32_t)d[9] << 24);
+			lo[k] = vmovl_u16(vget_low_u16(vreinterpretq_u16_u8(vld1q_u8(d))));
+			lo[k] = vsetq_lane_u32(press, lo[k], 3);
+			hi[k] = vmovl_u16(vget_high_u16(vreinterpretq_u16_u8(vld1q_u8(d + 4))));
+			b->time_ms[i + k] = record_time_ms(f);
+			b->noise[i + k] = d[10] | (d[11] << 8);
+		}
+		store_columns(lo, &b->temp[i], &b->humid[i], &b->light[i], &b->press[i]);
+		store_columns(hi, &b->TVOC[i], &b->CO2[i], &b->discom[i], &b->heat[i]);
+	}
+	for (; i < count; i++) {
+		decode_one(b, frames + i * MEMDATA_RECORD_LEN, i);
+	}
+	b->count = count;
+}
+#endif
+
+/*
+ * engine selection, done once
+ */
+static void batch_decode_select(void) {
+	decode_fn = sensor_batch_decode_scalar;
+	decode_name = "scalar";
+#ifdef BATCH_SSSE3
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		decode_fn = batch_decode_ssse3;
+		decode_name = "ssse3";
+	}
+#endif
+#ifdef BATCH_NEON
+	decode_fn = batch_decode_neon;
+	decode_name = "neon";
+#endif
+}
+
+/*
+ * batch decode with the best engine for this cpu
+ */
+void sensor_batch_decode(struct sensor_batch *b, const uint8_t *frames, uint32_t count) {
+	if (decode_fn == NULL) {
+		batch_decode_select();
+	}
+	decode_fn(b, frames, count);
+}
+
+/*
+ * name of the engine sensor_batch_decode() uses
+ */
+const char *sensor_batch_decode_impl(void) {
+	if (decode_fn == NULL) {
+		batch_decode_select();
+	}
+	return decode_name;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __BATCH_DECODE__
+#define __BATCH_DECODE__
+
+#include <stdint.h>
+
+#include "common.h"
+
+// memory data response (4.4.2 Memory data short), one record per frame
+#define MEMDATA_RECORD_LEN	(41)
+#define MEMDATA_TIME_OFFSET	(11)	// time counter, u64 seconds
+#define MEMDATA_DATA_OFFSET	(19)	// Table84 sensing data, 20 bytes
+
+void sensor_batch_decode_scalar(struct sensor_batch *b, const uint8_t *frames, uint32_t count);
+
+void sensor_batch_decode(struct sensor_batch *b, const uint8_t *frames, uint32_t count);
+
+const char *sensor_batch_decode_impl(void);
+
+#endif /* __BATCH_DECODE__ */
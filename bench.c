@@ -0,0 +1,632 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * decode pipeline benchmark
+ * Measures the CRC engines, the Table84 decode, record formatting and the
+ * whole memory data path against the pty emulator. The CRC engines and
+ * the batch decoders are first checked against the reference ones, a
+ * mismatch fails the run. Each result is printed
+ * as one JSON object per line:
+ *   {"bench":name,"records":n,"ns_per_record":x,"records_per_s":y,"allocs":z}
+ * allocs counts malloc/calloc/realloc calls made while the case ran.
+ * The block store cases add a line with the stored size:
+ *   {"bench":"store_size","records":n,"bytes_per_record":x,"ratio":y}
+ * ratio is against BIN_RECORD_LEN byte binary records.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <signal.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "batch_decode.h"
+#include "block_store.h"
+#include "crc16.h"
+#include "data_output.h"
+#include "device.h"
+#include "sensor_data.h"
+
+#define FRAME_LEN		(41)	// memory data response, one record
+#define DATA_OFFSET		(19)
+#define FRAME_COUNT		(4096)	// synthetic frames, reused round robin
+
+#define CRC_CHECK_MAX		(300)	// longest random buffer
+#define CRC_CHECK_ROUNDS	(20000)
+
+#define DEFAULT_RECORDS		(2000000)
+#define DEFAULT_EMU_RECORDS	(200000)
+#define DEFAULT_EMULATOR	"./2jcie-emu"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long alloc_count;
+static volatile uint32_t sink;
+
+/*
+ * allocation counting
+ * glibc lets the program replace malloc, libc itself then calls these too.
+ */
+void *malloc(size_t size) {
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+
+static void usage(char *basename) {
+	printf("usage: %s [options]\n\n", basename);
+	printf(
+		"options:\n"
+		"  -n, --records <n>      : Records per synthetic case. (default %d)\n"
+		"  -e, --emu-records <n>  : Records read through the emulator, 0 skips it. (default %d)\n"
+		"  -E, --emulator <path>  : Emulator binary. (default %s)\n",
+		DEFAULT_RECORDS, DEFAULT_EMU_RECORDS, DEFAULT_EMULATOR);
+}
+
+static const struct option long_options[] = {
+	{ "records",		required_argument,	NULL,	'n' },
+	{ "emu-records",	required_argument,	NULL,	'e' },
+	{ "emulator",		required_argument,	NULL,	'E' },
+	{ "help",		no_argument,		NULL,	'h' },
+	{ NULL,			0,			NULL,	0 },
+};
+
+struct bench_clock {
+	struct timespec start;
+	unsigned long allocs;
+};
+
+static void bench_start(struct bench_clock *bc) {
+	bc->allocs = alloc_count;
+	clock_gettime(CLOCK_MONOTONIC, &bc->start);
+}
+
+/*
+ * print one result line
+ */
+static void bench_end(struct bench_clock *bc, const char *name, unsigned long records) {
+	struct timespec end;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - bc->start.tv_sec) * 1e9 + (end.tv_nsec - bc->start.tv_nsec);
+	printf("{\"bench\":\"%s\",\"records\":%lu,\"ns_per_record\":%.2f,\"records_per_s\":%.0f,\"allocs\":%lu}\n",
+	       name, records, ns / records, records / (ns / 1e9), alloc_count - bc->allocs);
+	fflush(stdout);
+}
+
+/*
+ * synthetic memory data frames
+ * Same layout and value ranges as the emulator produces.
+ */
+static uint8_t *make_frames(void) {
+	uint8_t *frames, *f, *d;
+	unsigned short crc16;
+	uint32_t i, v;
+
+	frames = malloc(FRAME_COUNT * FRAME_LEN);
+	if (frames == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < FRAME_COUNT; i++) {
+		f = frames + i * FRAME_LEN;
+		memset(f, 0, FRAME_LEN);
+		f[0] = 0x52;
+		f[1] = 0x42;
+		f[2] = FRAME_LEN - 4;
+		f[4] = 0x01;
+		f[5] = 0x0f;
+		f[6] = 0x50;
+		memcpy(f + 7, &i, 4);
+		d = f + DATA_OFFSET;
+		v = 2000 + i % 1000;	d[0] = v; d[1] = v >> 8;
+		v = 4000 + i % 2000;	d[2] = v; d[3] = v >> 8;
+		v = 300 + i % 500;	d[4] = v; d[5] = v >> 8;
+		v = 1000000 + i % 30000; d[6] = v; d[7] = v >> 8; d[8] = v >> 16; d[9] = v >> 24;
+		v = 4000 + i % 3000;	d[10] = v; d[11] = v >> 8;
+		v = i % 200;		d[12] = v; d[13] = v >> 8;
+		v = 400 + i % 1000;	d[14] = v; d[15] = v >> 8;
+		v = 6000 + i % 2000;	d[16] = v; d[17] = v >> 8;
+		v = 1500 + i % 1000;	d[18] = v; d[19] = v >> 8;
+		crc16 = crc16_bit_calc(f, FRAME_LEN - 2);
+		f[FRAME_LEN - 2] = crc16 & 0xff;
+		f[FRAME_LEN - 1] = crc16 >> 8;
+	}
+	return frames;
+}
+
+/*
+ * crc of every frame
+ */
+static void bench_crc(const char *name, unsigned short (*calc)(const unsigned char *, int),
+		      const uint8_t *frames, unsigned long records) {
+	struct bench_clock bc;
+	unsigned long i;
+	uint32_t acc = 0;
+
+	bench_start(&bc);
+	for (i = 0; i < records; i++) {
+		acc += calc(frames + (i % FRAME_COUNT) * FRAME_LEN, FRAME_LEN - 2);
+	}
+	bench_end(&bc, name, records);
+	sink = acc;
+}
+
+/*
+ * every crc engine must give the bit by bit result
+ * Random buffers of 0..CRC_CHECK_MAX bytes at every alignment, plus the
+ * CRC-16/MODBUS check value.
+ */
+static int check_crc(void) {
+	static const struct {
+		const char *name;
+		unsigned short (*calc)(const unsigned char *, int);
+	} engines[] = {
+		{ "crc16_table", crc16_table_calc },
+		{ "crc16_slice8", crc16_slice8_calc },
+		{ "crc16", crc16_calc },
+	};
+	uint8_t buf[CRC_CHECK_MAX + 8];
+	unsigned short ref, crc;
+	unsigned int seed = 1;
+	int round, len, align, i;
+	size_t e;
+
+	if (crc16_bit_calc((const unsigned char *)"123456789", 9) != 0x4b37) {
+		fprintf(stderr, "crc16_bit check value wrong.\n");
+		return -1;
+	}
+	for (round = 0; round < CRC_CHECK_ROUNDS; round++) {
+		len = rand_r(&seed) % (CRC_CHECK_MAX + 1);
+		align = round % 8;
+		for (i = 0; i < len; i++) {
+			buf[align + i] = rand_r(&seed);
+		}
+		ref = crc16_bit_calc(buf + align, len);
+		for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+			crc = engines[e].calc(buf + align, len);
+			if (crc != ref) {
+				fprintf(stderr, "%s gives %04x instead of %04x, length %d, offset %d.\n",
+				        engines[e].name, crc, ref, len, align);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Table84 decode only
+ */
+static void bench_decode(const uint8_t *frames, unsigned long records) {
+	struct bench_clock bc;
+	struct sensor_raw_t raw;
+	unsigned long i;
+	uint32_t acc = 0;
+
+	bench_start(&bc);
+	for (i = 0; i < records; i++) {
+		sensor_raw_decode(&raw, frames + (i % FRAME_COUNT) * FRAME_LEN + DATA_OFFSET);
+		acc += raw.temp + raw.press + raw.heat;
+	}
+	bench_end(&bc, "decode", records);
+	sink = acc;
+}
+
+/*
+ * Table84 decode of whole windows into columns
+ */
+static void bench_batch_decode(const char *name,
+			       void (*decode)(struct sensor_batch *, const uint8_t *, uint32_t),
+			       const uint8_t *frames, unsigned long records) {
+	static struct sensor_batch batch;
+	struct bench_clock bc;
+	unsigned long i;
+	uint32_t acc = 0;
+
+	bench_start(&bc);
+	for (i = 0; i < records; i += SENSOR_BATCH_MAX) {
+		decode(&batch, frames + (i % FRAME_COUNT) * FRAME_LEN, SENSOR_BATCH_MAX);
+		acc += batch.temp[0] + batch.press[SENSOR_BATCH_MAX - 1];
+	}
+	bench_end(&bc, name, i);
+	sink = acc;
+}
+
+/*
+ * the selected batch engine must match the scalar one, odd counts included
+ */
+static int check_batch_decode(const uint8_t *frames) {
+	static struct sensor_batch ref, batch;
+	uint32_t count;
+
+	for (count = 1; count <= SENSOR_BATCH_MAX; count += 7) {
+		memset(&batch, 0xa5, sizeof(batch));
+		memset(&ref, 0xa5, sizeof(ref));
+		sensor_batch_decode_scalar(&ref, frames + count * FRAME_LEN, count);
+		sensor_batch_decode(&batch, frames + count * FRAME_LEN, count);
+		if (memcmp(&ref, &batch, sizeof(ref)) != 0) {
+			fprintf(stderr, "batch decode %s differs from scalar, count %u.\n",
+			        sensor_batch_decode_impl(), count);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * batch decode and output to /dev/null, the memory data path per window
+ */
+static int bench_batch_output(const char *name, int format, const uint8_t *frames, unsigned long records) {
+	static struct data_writer writer;
+	static struct sensor_batch batch;
+	struct bench_clock bc;
+	unsigned long i;
+	FILE *fp;
+
+	fp = fopen("/dev/null", "w");
+	if (fp == NULL) {
+		perror("/dev/null");
+		return -1;
+	}
+	output_format_set(format);
+	data_writer_init(&writer, fp);
+	batch.flags = SAMPLE_FLAG_MEMORY;
+
+	bench_start(&bc);
+	for (i = 0; i < records; i += SENSOR_BATCH_MAX) {
+		sensor_batch_decode(&batch, frames + (i % FRAME_COUNT) * FRAME_LEN, SENSOR_BATCH_MAX);
+		usb_batch_output(&writer, NULL, &batch);
+	}
+	data_writer_flush(&writer);
+	bench_end(&bc, name, i);
+
+	fclose(fp);
+	output_format_set(OUTPUT_CSV);
+	return 0;
+}
+
+/*
+ * record output to /dev/null, decode and format (data_analyses) or format only
+ */
+static int bench_output(const char *name, int format, int decode,
+			const uint8_t *frames, unsigned long records) {
+	static struct data_writer writer;
+	struct sensor_sample_t sample;
+	struct bench_clock bc;
+	unsigned long i;
+	FILE *fp;
+
+	fp = fopen("/dev/null", "w");
+	if (fp == NULL) {
+		perror("/dev/null");
+		return -1;
+	}
+	output_format_set(format);
+	data_writer_init(&writer, fp);
+
+	memset(&sample, 0, sizeof(sample));
+	sensor_raw_decode(&sample.raw, frames + DATA_OFFSET);
+	sample.flags = SAMPLE_FLAG_MEMORY;
+
+	bench_start(&bc);
+	for (i = 0; i < records; i++) {
+		if (decode) {
+			sensor_raw_decode(&sample.raw, frames + (i % FRAME_COUNT) * FRAME_LEN + DATA_OFFSET);
+		}
+		sample.time_ms += 1000;
+		usb_data_output(&writer, NULL, &sample);
+	}
+	data_writer_flush(&writer);
+	bench_end(&bc, name, records);
+
+	fclose(fp);
+	output_format_set(OUTPUT_CSV);
+	return 0;
+}
+
+/*
+ * slowly drifting series, a sample a second with some clock jitter
+ */
+struct series {
+	uint32_t seed;
+	struct sensor_sample_t sample;
+};
+
+static void series_init(struct series *s) {
+	memset(s, 0, sizeof(*s));
+	s->seed = 1;
+	s->sample.time_ms = 1700000000000ULL;
+	s->sample.raw = (struct sensor_raw_t){ 2250, 4500, 320, 1013250, 4200, 12, 420, 6800, 1800 };
+}
+
+static const struct sensor_sample_t *series_next(struct series *s) {
+	struct sensor_raw_t *raw = &s->sample.raw;
+	int32_t *v[] = {
+		&raw->temp, &raw->humid, &raw->light, &raw->press, &raw->noise,
+		&raw->TVOC, &raw->CO2, &raw->discom, &raw->heat,
+	};
+	uint32_t i, r;
+
+	s->seed = s->seed * 1103515245 + 12345;
+	r = s->seed >> 8;
+	s->sample.time_ms += 998 + r % 5;
+	for (i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+		// each field steps by one about every fourth sample
+		switch ((r >> (2 * i)) & 7) {
+		case 0:
+			(*v[i])++;
+			break;
+		case 1:
+			(*v[i])--;
+			break;
+		}
+	}
+	return &s->sample;
+}
+
+struct store_check {
+	struct series series;
+	unsigned long count;
+	int differ;
+};
+
+static int store_check_visit(void *ctx, const struct sensor_sample_t *sample) {
+	struct store_check *c = ctx;
+	const struct sensor_sample_t *ref = series_next(&c->series);
+
+	if (ref->time_ms != sample->time_ms || memcmp(&ref->raw, &sample->raw, sizeof(ref->raw)) != 0) {
+		c->differ = 1;
+		return 1;
+	}
+	c->count++;
+	return 0;
+}
+
+/*
+ * block store append and full range query, read back must match
+ */
+static int bench_store(unsigned long records) {
+	static struct block_store bs;
+	struct store_check check;
+	struct series series;
+	struct bench_clock bc;
+	char path[] = "/tmp/2jcie-bench-store.XXXXXX";
+	char idx_path[sizeof(path) + 4];
+	struct stat st;
+	unsigned long i;
+	int fd, ret = -1;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	close(fd);
+	snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+	if (block_store_open(&bs, path)) {
+		goto exit_unlink;
+	}
+
+	series_init(&series);
+	bench_start(&bc);
+	for (i = 0; i < records; i++) {
+		block_store_append(&bs, series_next(&series));
+	}
+	bench_end(&bc, "store_append", records);
+	block_store_close(&bs);
+
+	if (stat(path, &st) == 0) {
+		printf("{\"bench\":\"store_size\",\"records\":%lu,\"bytes_per_record\":%.2f,\"ratio\":%.2f}\n",
+		       records, (double)st.st_size / records, (double)records * BIN_RECORD_LEN / st.st_size);
+	}
+
+	if (block_store_open(&bs, path)) {
+		goto exit_unlink;
+	}
+	memset(&check, 0, sizeof(check));
+	series_init(&check.series);
+	bench_start(&bc);
+	block_store_query(&bs, 0, UINT64_MAX, store_check_visit, &check);
+	bench_end(&bc, "store_query", records);
+	block_store_close(&bs);
+
+	if (check.differ || check.count != records) {
+		fprintf(stderr, "block store read back differs after %lu records.\n", check.count);
+	} else {
+		ret = 0;
+	}
+
+exit_unlink:
+	unlink(path);
+	unlink(idx_path);
+	return ret;
+}
+
+/*
+ * start the emulator, its first output line is the slave path
+ */
+static pid_t start_emulator(const char *emulator, unsigned long records, char *path, size_t path_len) {
+	char count[32];
+	int pfd[2];
+	pid_t pid;
+	FILE *fp;
+
+	if (pipe(pfd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+	snprintf(count, sizeof(count), "%lu", records);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(pfd[1], STDOUT_FILENO);
+		close(pfd[0]);
+		close(pfd[1]);
+		execl(emulator, emulator, "-n", count, (char *)NULL);
+		perror(emulator);
+		_exit(127);
+	}
+
+	close(pfd[1]);
+	fp = fdopen(pfd[0], "r");
+	if (fp == NULL || fgets(path, path_len, fp) == NULL) {
+		fprintf(stderr, "emulator %s did not start.\n", emulator);
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	fclose(fp);
+	path[strcspn(path, "\n")] = '\0';
+	return pid;
+}
+
+/*
+ * whole memory data path: serial frames, crc, decode, csv to /dev/null
+ */
+static int bench_memdata(const char *emulator, unsigned long records) {
+	static struct sensor_device dev;
+	struct bench_clock bc;
+	char path[64];
+	pid_t pid;
+	int ret;
+
+	pid = start_emulator(emulator, records, path, sizeof(path));
+	if (pid < 0) {
+		return -1;
+	}
+
+	ret = device_open(&dev, path, 0);
+	if (ret == 0) {
+		bench_start(&bc);
+		ret = get_memory_data(&dev, "/dev/null", NULL);
+		if (ret == 0) {
+			bench_end(&bc, "memdata_emulator", records);
+		}
+		device_close(&dev);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long records = DEFAULT_RECORDS;
+	unsigned long emu_records = DEFAULT_EMU_RECORDS;
+	const char *emulator = DEFAULT_EMULATOR;
+	char name[64];
+	uint8_t *frames;
+	char *end;
+	int opt, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "n:e:E:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+		case 'e':
+			errno = 0;
+			*(opt == 'n' ? &records : &emu_records) = strtoul(optarg, &end, 0);
+			if (errno || *end != '\0') {
+				printf("invalid value: -%c %s\n", opt, optarg);
+				return 1;
+			}
+			break;
+		case 'E':
+			emulator = optarg;
+			break;
+		case 'h':
+			usage(basename(argv[0]));
+			return 0;
+		default:
+			usage(basename(argv[0]));
+			return 1;
+		}
+	}
+	if (records == 0) {
+		records = DEFAULT_RECORDS;
+	}
+
+	frames = make_frames();
+	if (frames == NULL) {
+		fprintf(stderr, "out of memory.\n");
+		return 1;
+	}
+
+	if (check_crc()) {
+		free(frames);
+		return 1;
+	}
+	bench_crc("crc16_bit", crc16_bit_calc, frames, records);
+	bench_crc("crc16_table", crc16_table_calc, frames, records);
+	bench_crc("crc16_slice8", crc16_slice8_calc, frames, records);
+	bench_crc("crc16", crc16_calc, frames, records);
+	bench_decode(frames, records);
+	if (check_batch_decode(frames)) {
+		free(frames);
+		return 1;
+	}
+	bench_batch_decode("batch_decode_scalar", sensor_batch_decode_scalar, frames, records);
+	snprintf(name, sizeof(name), "batch_decode_%s", sensor_batch_decode_impl());
+	bench_batch_decode(name, sensor_batch_decode, frames, records);
+	if (bench_output("output_csv", OUTPUT_CSV, 0, frames, records) ||
+	    bench_output("output_bin", OUTPUT_BIN, 0, frames, records) ||
+	    bench_output("analyses_csv", OUTPUT_CSV, 1, frames, records) ||
+	    bench_batch_output("batch_csv", OUTPUT_CSV, frames, records) ||
+	    bench_batch_output("batch_bin", OUTPUT_BIN, frames, records) ||
+	    bench_store(records)) {
+		ret = 1;
+	}
+	if (emu_records > 0 && bench_memdata(emulator, emu_records)) {
+		fprintf(stderr, "memory data benchmark failed.\n");
+		ret = 1;
+	}
+
+	free(frames);
+	return ret;
+}
@@ -0,0 +1,887 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "common.h"
+#include "data_output.h"
+#include "device.h"
+#include "block_store.h"
+
+#define INDEX_SUFFIX	".idx"
+#define READ_BLOCKS	(16)	// blocks per sequential read of a query
+
+#define V1_RECORDS	((STORE_BLOCK_LEN - STORE_BLOCK_HEADER_LEN) / BIN_RECORD_LEN)
+#define PAYLOAD_OFFSET	(STORE_BLOCK_HEADER_LEN + STORE_COLUMNS * 2)
+#define PAYLOAD_LEN	(STORE_BLOCK_LEN - PAYLOAD_OFFSET)
+
+#define COL_TIME	(0)
+#define COL_FLAGS	(1)
+#define COL_FIELD	(2)
+
+/*
+ * code classes
+ * Class k is written as k one bits and a zero (the last class without
+ * the zero), then the zigzag value in the class width.
+ */
+#define CODE_CLASSES	(5)
+
+static const uint8_t time_bits[CODE_CLASSES] = { 0, 7, 12, 20, 64 };
+static const uint8_t value_bits[CODE_CLASSES] = { 0, 4, 8, 16, 32 };
+
+static int code_class(uint64_t z, const uint8_t *bits) {
+	int k;
+
+	if (z == 0) {
+		return 0;
+	}
+	for (k = 1; k < CODE_CLASSES - 1; k++) {
+		if (z < (1ULL << bits[k])) {
+			return k;
+		}
+	}
+	return k;
+}
+
+static int code_len(uint64_t z, const uint8_t *bits) {
+	int k = code_class(z, bits);
+
+	return (k < CODE_CLASSES - 1 ? k + 1 : k) + bits[k];
+}
+
+static uint64_t zigzag(int64_t v) {
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t z) {
+	return (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+}
+
+static void raw_get(const struct sensor_raw_t *raw, int32_t *v) {
+	v[0] = raw->temp;
+	v[1] = raw->humid;
+	v[2] = raw->light;
+	v[3] = raw->press;
+	v[4] = raw->noise;
+	v[5] = raw->TVOC;
+	v[6] = raw->CO2;
+	v[7] = raw->discom;
+	v[8] = raw->heat;
+}
+
+static int32_t *raw_field(struct sensor_raw_t *raw, int field) {
+	int32_t *fields[STORE_FIELDS] = {
+		&raw->temp, &raw->humid, &raw->light, &raw->press, &raw->noise,
+		&raw->TVOC, &raw->CO2, &raw->discom, &raw->heat,
+	};
+
+	return fields[field];
+}
+
+/*
+ * column codes of one record, advancing the encoder state
+ * z[COL_FLAGS] is 0 for a repeat, anything else means the flags follow.
+ */
+static void record_codes(struct store_column_state *st, const struct sensor_sample_t *s,
+			 uint64_t *z) {
+	int32_t v[STORE_FIELDS];
+	int64_t delta;
+	int i;
+
+	delta = (int64_t)(s->time_ms - st->time_ms);
+	z[COL_TIME] = zigzag(delta - st->delta_ms);
+	st->time_ms = s->time_ms;
+	st->delta_ms = delta;
+
+	z[COL_FLAGS] = s->flags != st->flags;
+	st->flags = s->flags;
+
+	raw_get(&s->raw, v);
+	for (i = 0; i < STORE_FIELDS; i++) {
+		// 32 bit wrap keeps every delta within 32 bits
+		z[COL_FIELD + i] = zigzag((int32_t)((uint32_t)v[i] - (uint32_t)st->v[i]));
+		st->v[i] = v[i];
+	}
+}
+
+static void record_bits(const uint64_t *z, uint32_t *bits) {
+	int i;
+
+	bits[COL_TIME] = code_len(z[COL_TIME], time_bits);
+	bits[COL_FLAGS] = z[COL_FLAGS] ? 17 : 1;
+	for (i = COL_FIELD; i < STORE_COLUMNS; i++) {
+		bits[i] = code_len(z[i], value_bits);
+	}
+}
+
+static void state_init(struct store_column_state *st, uint64_t first_ms) {
+	memset(st, 0, sizeof(*st));
+	st->time_ms = first_ms;
+}
+
+/*
+ * bit streams, most significant bit first
+ * The writer collects bits in acc and stores whole bytes.
+ */
+struct bit_writer {
+	uint8_t *p;
+	uint64_t acc;
+	int bits;
+};
+
+// n up to 32
+static void put_bits(struct bit_writer *w, uint64_t v, int n) {
+	if (n == 0) {
+		return;
+	}
+	w->acc = (w->acc << n) | (v & ((1ULL << n) - 1));
+	w->bits += n;
+	while (w->bits >= 8) {
+		w->bits -= 8;
+		*w->p++ = w->acc >> w->bits;
+	}
+}
+
+static void put_code(struct bit_writer *w, uint64_t z, const uint8_t *bits) {
+	int k = code_class(z, bits);
+
+	put_bits(w, k < CODE_CLASSES - 1 ? (1u << (k + 1)) - 2 : (1u << k) - 1,
+		 k < CODE_CLASSES - 1 ? k + 1 : k);
+	if (bits[k] > 32) {
+		put_bits(w, z >> 32, bits[k] - 32);
+		z &= 0xffffffff;
+	}
+	put_bits(w, z, bits[k] > 32 ? 32 : bits[k]);
+}
+
+static void put_flush(struct bit_writer *w) {
+	if (w->bits > 0) {
+		*w->p++ = w->acc << (8 - w->bits);
+		w->bits = 0;
+	}
+}
+
+/*
+ * reader side, a left aligned 64 bit window refilled a byte at a time
+ */
+struct bit_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+	uint64_t acc;
+	int bits;
+	int error;
+};
+
+static void bit_reader_init(struct bit_reader *r, const uint8_t *buf, size_t len) {
+	r->p = buf;
+	r->end = buf + len;
+	r->acc = 0;
+	r->bits = 0;
+	r->error = 0;
+}
+
+static __always_inline void refill(struct bit_reader *r) {
+	uint64_t w;
+
+	// whole words while away from the column end
+	if (r->end - r->p >= 8) {
+		memcpy(&w, r->p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		w = __builtin_bswap64(w);
+#endif
+		r->acc |= w >> r->bits;
+		r->p += (63 - r->bits) >> 3;
+		r->bits |= 56;
+		return;
+	}
+	while (r->bits <= 56 && r->p < r->end) {
+		r->acc |= (uint64_t)*r->p++ << (56 - r->bits);
+		r->bits += 8;
+	}
+}
+
+// n up to 56
+static __always_inline uint64_t get_bits(struct bit_reader *r, int n) {
+	uint64_t v;
+
+	if (n == 0) {
+		return 0;
+	}
+	refill(r);
+	if (r->bits < n) {
+		r->error = 1;
+		return 0;
+	}
+	v = r->acc >> (64 - n);
+	r->acc <<= n;
+	r->bits -= n;
+	return v;
+}
+
+static __always_inline uint64_t get_code(struct bit_reader *r, const uint8_t *bits) {
+	uint64_t v;
+	int k, n, len;
+
+	if (r->bits < CODE_CLASSES - 1 + 32) {
+		refill(r);
+	}
+	k = r->acc == ~0ULL ? 64 : __builtin_clzll(~r->acc);
+	if (k > CODE_CLASSES - 1) {
+		k = CODE_CLASSES - 1;
+	}
+	n = k + (k < CODE_CLASSES - 1);
+	len = n + bits[k];
+
+	// wide codes and the column end take the slow way
+	if (len > r->bits || bits[k] > 32) {
+		if (r->bits < n) {
+			r->error = 1;
+			return 0;
+		}
+		r->acc <<= n;
+		r->bits -= n;
+		if (bits[k] > 32) {
+			// high part first, the two reads are separate statements
+			v = get_bits(r, bits[k] - 32) << 32;
+			return v | get_bits(r, 32);
+		}
+		return get_bits(r, bits[k]);
+	}
+
+	// shifted in two steps so a zero width gives 0 without a branch
+	v = ((r->acc << n) >> 1) >> (63 - bits[k]);
+	r->acc <<= len;
+	r->bits -= len;
+	return v;
+}
+
+/*
+ * consume a run of zero codes, up to max of them
+ * Unchanged values are the common case, they are taken a word at a time.
+ */
+static __always_inline int get_zero_run(struct bit_reader *r, int max) {
+	int run;
+
+	if (r->bits < 57) {
+		refill(r);
+	}
+	run = r->acc == 0 ? 64 : __builtin_clzll(r->acc);
+	if (run > r->bits) {
+		run = r->bits;
+	}
+	if (run > max) {
+		run = max;
+	}
+	if (run == 0) {
+		return 0;
+	}
+	r->acc = run < 64 ? r->acc << run : 0;
+	r->bits -= run;
+	return run;
+}
+
+static struct store_block_header *block_header(uint8_t *block) {
+	return (struct store_block_header *)block;
+}
+
+static int block_valid(const struct store_block_header *hdr) {
+	if (memcmp(hdr->magic, STORE_MAGIC, 4) != 0) {
+		return 0;
+	}
+	if (hdr->version == 1) {
+		return hdr->count <= V1_RECORDS;
+	}
+	return hdr->version == STORE_VERSION && hdr->count <= STORE_BLOCK_RECORDS;
+}
+
+/*
+ * start an empty block
+ */
+static void block_reset(struct block_store *bs) {
+	bs->count = 0;
+	memset(bs->col_bits, 0, sizeof(bs->col_bits));
+}
+
+/*
+ * would one more record with these column sizes fit
+ */
+static int block_fits(struct block_store *bs, const uint32_t *bits) {
+	uint32_t len = 0;
+	int i;
+
+	if (bs->count >= STORE_BLOCK_RECORDS) {
+		return 0;
+	}
+	for (i = 0; i < STORE_COLUMNS; i++) {
+		len += (bs->col_bits[i] + bits[i] + 7) / 8;
+	}
+	return len <= PAYLOAD_LEN;
+}
+
+/*
+ * add a record to the block being filled, 0 when it is full
+ */
+static int block_add(struct block_store *bs, const struct sensor_sample_t *sample) {
+	struct store_column_state st;
+	uint64_t z[STORE_COLUMNS];
+	uint32_t bits[STORE_COLUMNS];
+	int i;
+
+	if (bs->count == 0) {
+		state_init(&bs->enc, sample->time_ms);
+	}
+	st = bs->enc;
+	record_codes(&st, sample, z);
+	record_bits(z, bits);
+	if (!block_fits(bs, bits)) {
+		return 0;
+	}
+
+	bs->enc = st;
+	for (i = 0; i < STORE_COLUMNS; i++) {
+		bs->col_bits[i] += bits[i];
+	}
+	bs->samples[bs->count++] = *sample;
+	return 1;
+}
+
+/*
+ * encode the block being filled into bs->block
+ */
+static void block_encode(struct block_store *bs, uint16_t state) {
+	struct store_block_header *hdr = block_header(bs->block);
+	struct store_column_state st;
+	struct bit_writer w[STORE_COLUMNS];
+	uint64_t z[STORE_COLUMNS];
+	uint16_t *table = (uint16_t *)(bs->block + STORE_BLOCK_HEADER_LEN);
+	uint32_t offset = PAYLOAD_OFFSET;
+	int i, c;
+
+	memset(bs->block, 0, sizeof(bs->block));
+	memcpy(hdr->magic, STORE_MAGIC, 4);
+	hdr->version = STORE_VERSION;
+	hdr->count = bs->count;
+	hdr->device_id = bs->samples[0].device_id;
+	hdr->state = state;
+	hdr->first_ms = bs->samples[0].time_ms;
+	hdr->last_ms = bs->samples[bs->count - 1].time_ms;
+
+	for (c = 0; c < STORE_COLUMNS; c++) {
+		w[c].p = bs->block + offset;
+		w[c].acc = 0;
+		w[c].bits = 0;
+		offset += (bs->col_bits[c] + 7) / 8;
+		table[c] = offset;
+	}
+
+	state_init(&st, hdr->first_ms);
+	for (i = 0; i < bs->count; i++) {
+		record_codes(&st, &bs->samples[i], z);
+		put_code(&w[COL_TIME], z[COL_TIME], time_bits);
+		put_bits(&w[COL_FLAGS], z[COL_FLAGS], 1);
+		if (z[COL_FLAGS]) {
+			put_bits(&w[COL_FLAGS], st.flags, 16);
+		}
+		for (c = COL_FIELD; c < STORE_COLUMNS; c++) {
+			put_code(&w[c], z[c], value_bits);
+		}
+	}
+	for (c = 0; c < STORE_COLUMNS; c++) {
+		put_flush(&w[c]);
+	}
+}
+
+/*
+ * decode a block, column by column
+ * Returns the record count, -1 for a broken block.
+ */
+static int block_decode(uint8_t *block, struct sensor_sample_t *out) {
+	struct store_block_header *hdr = block_header(block);
+	const uint16_t *table = (const uint16_t *)(block + STORE_BLOCK_HEADER_LEN);
+	struct bit_reader r;
+	uint64_t time_ms;
+	int64_t delta = 0;
+	uint16_t flags = 0;
+	uint32_t start = PAYLOAD_OFFSET;
+	int32_t v, *field;
+	int count, device_id, run;
+	int i, c;
+
+	if (!block_valid(hdr)) {
+		return -1;
+	}
+	// locals, the stores to out may alias the header
+	count = hdr->count;
+	device_id = hdr->device_id;
+	if (hdr->version == 1) {
+		for (i = 0; i < hdr->count; i++) {
+			bin_parse(block + STORE_BLOCK_HEADER_LEN + i * BIN_RECORD_LEN, &out[i]);
+		}
+		return hdr->count;
+	}
+
+	for (c = 0; c < STORE_COLUMNS; c++) {
+		if (table[c] < start || table[c] > STORE_BLOCK_LEN) {
+			return -1;
+		}
+		bit_reader_init(&r, block + start, table[c] - start);
+		start = table[c];
+		run = 0;
+
+		switch (c) {
+		case COL_TIME:
+			time_ms = hdr->first_ms;
+			for (i = 0; i < count; i++) {
+				if (run == 0) {
+					run = get_zero_run(&r, count - i);
+					if (run == 0) {
+						delta += unzigzag(get_code(&r, time_bits));
+						run = 1;
+					}
+				}
+				run--;
+				time_ms += delta;
+				out[i].time_ms = time_ms;
+				out[i].device_id = device_id;
+			}
+			break;
+		case COL_FLAGS:
+			for (i = 0; i < count; i++) {
+				if (get_bits(&r, 1)) {
+					flags = get_bits(&r, 16);
+				}
+				out[i].flags = flags;
+			}
+			break;
+		default:
+			v = 0;
+			field = raw_field(&out[0].raw, c - COL_FIELD);
+			for (i = 0; i < count; i++) {
+				if (run == 0) {
+					run = get_zero_run(&r, count - i);
+					if (run == 0) {
+						v = (int32_t)((uint32_t)v + (uint32_t)unzigzag(get_code(&r, value_bits)));
+						run = 1;
+					}
+				}
+				run--;
+				*field = v;
+				field = (int32_t *)((uint8_t *)field + sizeof(*out));
+			}
+			break;
+		}
+		if (r.error) {
+			return -1;
+		}
+	}
+	return count;
+}
+
+static long elapsed_ms(const struct timespec *from) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000 + (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * write the block being filled and its index entry
+ */
+static int block_write(struct block_store *bs, uint16_t state) {
+	struct store_index_entry entry;
+	ssize_t ret;
+
+	block_encode(bs, state);
+	entry.first_ms = block_header(bs->block)->first_ms;
+	entry.last_ms = block_header(bs->block)->last_ms;
+
+	ret = pwrite(bs->fd, bs->block, STORE_BLOCK_LEN, (off_t)bs->blocks * STORE_BLOCK_LEN);
+	if (ret != STORE_BLOCK_LEN) {
+		perror("store block write");
+		return -1;
+	}
+	ret = pwrite(bs->idx_fd, &entry, sizeof(entry), (off_t)bs->blocks * sizeof(entry));
+	if (ret != sizeof(entry)) {
+		perror("store index write");
+		return -1;
+	}
+	bs->dirty = 0;
+	clock_gettime(CLOCK_MONOTONIC, &bs->synced);
+	return 0;
+}
+
+/*
+ * index rebuild from the block headers
+ * Needed after a crash between a block and its index entry.
+ */
+static int index_rebuild(struct block_store *bs, uint64_t blocks) {
+	struct store_block_header hdr;
+	struct store_index_entry entry;
+	uint64_t n;
+
+	fprintf(stderr, "rebuilding store index (%llu blocks)\n", (unsigned long long)blocks);
+	if (ftruncate(bs->idx_fd, 0) < 0) {
+		perror("store index truncate");
+		return -1;
+	}
+	for (n = 0; n < blocks; n++) {
+		if (pread(bs->fd, &hdr, sizeof(hdr), (off_t)n * STORE_BLOCK_LEN) != sizeof(hdr) ||
+		    !block_valid(&hdr)) {
+			fprintf(stderr, "store block %llu broken\n", (unsigned long long)n);
+			return -1;
+		}
+		entry.first_ms = hdr.first_ms;
+		entry.last_ms = hdr.last_ms;
+		if (pwrite(bs->idx_fd, &entry, sizeof(entry), (off_t)n * sizeof(entry)) != sizeof(entry)) {
+			perror("store index write");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * continue the last block on disk when it is not sealed
+ */
+static int block_resume(struct block_store *bs, uint64_t *blocks) {
+	struct store_block_header *hdr = block_header(bs->block);
+	int count, i;
+
+	if (pread(bs->fd, bs->block, STORE_BLOCK_LEN, (off_t)(*blocks - 1) * STORE_BLOCK_LEN) !=
+	    STORE_BLOCK_LEN) {
+		perror("store block read");
+		return -1;
+	}
+	count = block_decode(bs->block, bs->samples);
+	if (count < 0) {
+		fprintf(stderr, "store last block broken\n");
+		return -1;
+	}
+	bs->newest_ms = hdr->last_ms;
+	// version 1 blocks are left as they are
+	if (hdr->version != STORE_VERSION || (hdr->state & STORE_BLOCK_SEALED)) {
+		return 0;
+	}
+
+	// re-encoding gives the same sizes, so every record fits again
+	for (i = 0; i < count; i++) {
+		block_add(bs, &bs->samples[i]);
+	}
+	(*blocks)--;
+	return 0;
+}
+
+/*
+ * block store open
+ * An existing store is continued: a last block that is not sealed is
+ * read back to be filled further, a missing or short index is rebuilt.
+ */
+int block_store_open(struct block_store *bs, const char *path) {
+	char idx_path[PATH_MAX];
+	struct stat st;
+	uint64_t blocks;
+
+	memset(bs, 0, sizeof(*bs));
+	bs->idx_fd = -1;
+	snprintf(idx_path, sizeof(idx_path), "%s%s", path, INDEX_SUFFIX);
+
+	bs->samples = malloc(STORE_BLOCK_RECORDS * sizeof(*bs->samples));
+	if (bs->samples == NULL) {
+		perror("store malloc");
+		bs->fd = -1;
+		return -1;
+	}
+
+	bs->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (bs->fd < 0) {
+		perror("store file open");
+		goto exit_free;
+	}
+	bs->idx_fd = open(idx_path, O_RDWR | O_CREAT, 0644);
+	if (bs->idx_fd < 0) {
+		perror("store index open");
+		goto exit_close;
+	}
+
+	if (fstat(bs->fd, &st) < 0) {
+		perror("store file stat");
+		goto exit_close;
+	}
+	// a torn last block is cut off
+	blocks = st.st_size / STORE_BLOCK_LEN;
+	if (ftruncate(bs->fd, (off_t)blocks * STORE_BLOCK_LEN) < 0) {
+		perror("store file truncate");
+		goto exit_close;
+	}
+
+	if (fstat(bs->idx_fd, &st) < 0) {
+		perror("store index stat");
+		goto exit_close;
+	}
+	if ((uint64_t)st.st_size != blocks * sizeof(struct store_index_entry) &&
+	    index_rebuild(bs, blocks) < 0) {
+		goto exit_close;
+	}
+
+	block_reset(bs);
+	if (blocks > 0 && block_resume(bs, &blocks) < 0) {
+		goto exit_close;
+	}
+	bs->blocks = blocks;
+	clock_gettime(CLOCK_MONOTONIC, &bs->synced);
+	pthread_mutex_init(&bs->lock, NULL);
+	return 0;
+
+exit_close:
+	if (bs->idx_fd >= 0) {
+		close(bs->idx_fd);
+		bs->idx_fd = -1;
+	}
+	if (bs->fd >= 0) {
+		close(bs->fd);
+		bs->fd = -1;
+	}
+exit_free:
+	free(bs->samples);
+	bs->samples = NULL;
+	return -1;
+}
+
+/*
+ * append one record
+ */
+static void append_locked(struct block_store *bs, const struct sensor_sample_t *sample) {
+	if (sample->time_ms <= bs->newest_ms && (bs->blocks > 0 || bs->count > 0)) {
+		bs->dropped++;
+		return;
+	}
+
+	if (!block_add(bs, sample)) {
+		if (block_write(bs, STORE_BLOCK_SEALED) == 0) {
+			bs->blocks++;
+		}
+		block_reset(bs);
+		block_add(bs, sample);
+	}
+	bs->newest_ms = sample->time_ms;
+	bs->dirty = 1;
+
+	if (elapsed_ms(&bs->synced) >= STORE_SYNC_MS) {
+		block_write(bs, 0);
+	}
+}
+
+void block_store_append(struct block_store *bs, const struct sensor_sample_t *sample) {
+	if (bs->fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&bs->lock);
+	append_locked(bs, sample);
+	pthread_mutex_unlock(&bs->lock);
+}
+
+/*
+ * first block whose last record is not older than since
+ */
+static int64_t index_search(struct block_store *bs, uint64_t since) {
+	struct store_index_entry entry;
+	uint64_t lo = 0, hi = bs->blocks, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pread(bs->idx_fd, &entry, sizeof(entry), (off_t)mid * sizeof(entry)) != sizeof(entry)) {
+			perror("store index read");
+			return -1;
+		}
+		if (entry.last_ms < since) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * visit the records within [since, until]
+ * Returns 1 once past until or stopped by fn.
+ */
+static int samples_visit(const struct sensor_sample_t *samples, int count,
+			 uint64_t since, uint64_t until, store_visit_fn fn, void *ctx) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (samples[i].time_ms < since) {
+			continue;
+		}
+		if (samples[i].time_ms > until || fn(ctx, &samples[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * query records with since <= time <= until in time order
+ * Returns the number of blocks read, -1 on error.
+ */
+int block_store_query(struct block_store *bs, uint64_t since, uint64_t until,
+		      store_visit_fn fn, void *ctx) {
+	struct sensor_sample_t *decoded = NULL;
+	uint8_t *buf = NULL;
+	int64_t first;
+	uint64_t n, count, i;
+	ssize_t len;
+	int blocks = 0, done = 0, records;
+
+	if (bs->fd < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&bs->lock);
+	first = index_search(bs, since);
+	if (first < 0) {
+		goto exit_error;
+	}
+
+	if ((uint64_t)first < bs->blocks) {
+		buf = malloc(READ_BLOCKS * STORE_BLOCK_LEN);
+		decoded = malloc(STORE_BLOCK_RECORDS * sizeof(*decoded));
+		if (buf == NULL || decoded == NULL) {
+			perror("store query malloc");
+			goto exit_error;
+		}
+	}
+	for (n = first; n < bs->blocks && !done; n += count) {
+		count = bs->blocks - n;
+		if (count > READ_BLOCKS) {
+			count = READ_BLOCKS;
+		}
+		len = pread(bs->fd, buf, count * STORE_BLOCK_LEN, (off_t)n * STORE_BLOCK_LEN);
+		if (len != (ssize_t)(count * STORE_BLOCK_LEN)) {
+			perror("store block read");
+			goto exit_error;
+		}
+		for (i = 0; i < count && !done; i++) {
+			records = block_decode(buf + i * STORE_BLOCK_LEN, decoded);
+			if (records < 0) {
+				fprintf(stderr, "store block %llu broken\n", (unsigned long long)(n + i));
+				goto exit_error;
+			}
+			done = samples_visit(decoded, records, since, until, fn, ctx);
+			blocks++;
+		}
+	}
+	if (!done && bs->count > 0) {
+		samples_visit(bs->samples, bs->count, since, until, fn, ctx);
+		blocks++;
+	}
+	pthread_mutex_unlock(&bs->lock);
+	free(decoded);
+	free(buf);
+	return blocks;
+
+exit_error:
+	pthread_mutex_unlock(&bs->lock);
+	free(decoded);
+	free(buf);
+	return -1;
+}
+
+/*
+ * output sink entries
+ * ctx is an array of MAX_DEVICES stores indexed by device id, a store
+ * that is not open ignores its records.
+ */
+void block_store_sink(void *ctx, const struct sensor_sample_t *sample) {
+	struct block_store *stores = ctx;
+
+	if (sample->device_id < MAX_DEVICES) {
+		block_store_append(&stores[sample->device_id], sample);
+	}
+}
+
+void block_store_batch_sink(void *ctx, const struct sensor_batch *b) {
+	struct block_store *stores = ctx;
+	struct block_store *bs;
+	struct sensor_sample_t sample;
+	uint32_t i;
+
+	// device time counter records would mix with wall clock ones
+	if (b->device_id >= MAX_DEVICES || (b->flags & SAMPLE_FLAG_MEMORY)) {
+		return;
+	}
+	bs = &stores[b->device_id];
+	if (bs->fd < 0) {
+		return;
+	}
+
+	sample.device_id = b->device_id;
+	sample.flags = b->flags;
+	pthread_mutex_lock(&bs->lock);
+	for (i = 0; i < b->count; i++) {
+		sample.time_ms = b->time_ms[i];
+		sample.raw.temp = b->temp[i];
+		sample.raw.humid = b->humid[i];
+		sample.raw.light = b->light[i];
+		sample.raw.press = b->press[i];
+		sample.raw.noise = b->noise[i];
+		sample.raw.TVOC = b->TVOC[i];
+		sample.raw.CO2 = b->CO2[i];
+		sample.raw.discom = b->discom[i];
+		sample.raw.heat = b->heat[i];
+		append_locked(bs, &sample);
+	}
+	pthread_mutex_unlock(&bs->lock);
+}
+
+/*
+ * block store close
+ * The block being filled is written out so nothing is lost.
+ */
+void block_store_close(struct block_store *bs) {
+	if (bs->fd < 0) {
+		return;
+	}
+	if (bs->dirty) {
+		block_write(bs, 0);
+	}
+	if (bs->dropped > 0) {
+		fprintf(stderr, "store dropped %lu records out of time order\n", bs->dropped);
+	}
+	fdatasync(bs->fd);
+	fdatasync(bs->idx_fd);
+	close(bs->idx_fd);
+	close(bs->fd);
+	bs->idx_fd = -1;
+	bs->fd = -1;
+	free(bs->samples);
+	bs->samples = NULL;
+	pthread_mutex_destroy(&bs->lock);
+}
@@ -0,0 +1,115 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __BLOCK_STORE__
+#define __BLOCK_STORE__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "common.h"
+#include "data_output.h"
+
+#define STORE_MAGIC		"2JCK"
+#define STORE_VERSION		(2)
+#define STORE_BLOCK_LEN		(4096)
+#define STORE_BLOCK_HEADER_LEN	(32)
+#define STORE_BLOCK_RECORDS	(2048)	// upper bound, a block is usually full by size first
+#define STORE_FIELDS		(9)	// Table84 fields, in sensor_raw_t order
+#define STORE_COLUMNS		(2 + STORE_FIELDS)	// time, flags and one per field
+#define STORE_SYNC_MS		(60 * 1000)	// a partial block is written out at least this often
+
+/*
+ * block store
+ * <path> holds STORE_BLOCK_LEN byte blocks in time order. A block is a
+ * header, a table of STORE_COLUMNS column end offsets and the columns as
+ * bit streams: timestamps as delta-of-delta, flags as repeats, every
+ * field as the delta to the record before it. Small deltas, the usual
+ * case for environment values, take one to a few bits. Each block starts
+ * its columns over, so it decodes on its own.
+ * <path>.idx holds one struct store_index_entry per block, so a time
+ * range is a binary search over the index plus one sequential read of
+ * the blocks it covers. Blocks are only appended; the last one is
+ * rewritten in place while it fills. A record older than the newest one
+ * stored is dropped. Times are unix msec, memory data dumps (device time
+ * counter, SAMPLE_FLAG_MEMORY) are not stored.
+ * Version 1 blocks (BIN_RECORD_LEN records after the header) are still
+ * read.
+ */
+struct store_block_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t count;
+	uint16_t device_id;
+	uint16_t state;			// STORE_BLOCK_SEALED once full
+	uint16_t reserved[2];
+	uint64_t first_ms;
+	uint64_t last_ms;
+};
+
+#define STORE_BLOCK_SEALED	(1 << 0)
+
+struct store_index_entry {
+	uint64_t first_ms;
+	uint64_t last_ms;
+};
+
+/*
+ * encoder state after the last record of a block
+ */
+struct store_column_state {
+	uint64_t time_ms;
+	int64_t delta_ms;
+	uint16_t flags;
+	int32_t v[STORE_FIELDS];
+};
+
+struct block_store {
+	int fd;
+	int idx_fd;
+	uint64_t blocks;		// complete blocks on disk
+	uint64_t newest_ms;
+	unsigned long dropped;		// records out of time order
+	int dirty;
+	struct timespec synced;
+	pthread_mutex_t lock;		// memory data arrives from the writer thread
+	struct sensor_sample_t *samples;	// records of the block being filled
+	uint16_t count;
+	uint32_t col_bits[STORE_COLUMNS];	// their encoded size per column
+	struct store_column_state enc;
+	uint8_t block[STORE_BLOCK_LEN];	// encode and decode buffer
+};
+
+// called for every record of a query, a non-zero return stops it
+typedef int (*store_visit_fn)(void *ctx, const struct sensor_sample_t *sample);
+
+int block_store_open(struct block_store *bs, const char *path);
+
+void block_store_append(struct block_store *bs, const struct sensor_sample_t *sample);
+
+int block_store_query(struct block_store *bs, uint64_t since, uint64_t until,
+		      store_visit_fn fn, void *ctx);
+
+void block_store_sink(void *ctx, const struct sensor_sample_t *sample);
+
+void block_store_batch_sink(void *ctx, const struct sensor_batch *b);
+
+void block_store_close(struct block_store *bs);
+
+#endif /* __BLOCK_STORE__ */
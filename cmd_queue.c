@@ -0,0 +1,152 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cmd_queue.h"
+#include "stats.h"
+
+#define CMD_ENTRY(q, n) (&(q)->entries[(n) & (CMD_QUEUE_LEN - 1)])
+
+static unsigned int pipeline_depth = 1;
+
+/*
+ * send while the sensor is still answering, see cmd_queue.h
+ */
+void cmd_queue_overlap_set(int enable) {
+	pipeline_depth = enable ? CMD_PIPELINE_DEPTH : 1;
+}
+
+void cmd_queue_init(struct cmd_queue *q) {
+	q->head = 0;
+	q->next = 0;
+	q->tail = 0;
+}
+
+/*
+ * queue a request
+ * Returns the entry to build the frame into, NULL when the queue is full.
+ */
+struct cmd_entry *cmd_queue_add(struct cmd_queue *q, size_t len, uint32_t responses) {
+	struct cmd_entry *e;
+
+	if (q->tail - q->head == CMD_QUEUE_LEN || len > CMD_FRAME_MAX) {
+		return NULL;
+	}
+	e = CMD_ENTRY(q, q->tail++);
+	e->len = len;
+	e->responses = responses;
+	e->received = 0;
+	e->sent_ns = 0;
+	return e;
+}
+
+/*
+ * next request the link takes now
+ * started tells that the answer to the request on the wire is far
+ * enough along for the next one to follow.
+ */
+struct cmd_entry *cmd_queue_ready(struct cmd_queue *q, int started) {
+	unsigned int on_wire = q->next - q->head;
+
+	if (q->next == q->tail) {
+		return NULL;
+	}
+	if (on_wire > 0 && (on_wire >= pipeline_depth || !started)) {
+		return NULL;
+	}
+	return CMD_ENTRY(q, q->next);
+}
+
+/*
+ * the ready request went out
+ */
+void cmd_queue_sent(struct cmd_queue *q, uint64_t now_ns) {
+	CMD_ENTRY(q, q->next++)->sent_ns = now_ns;
+}
+
+/*
+ * oldest request on the wire, NULL when none is outstanding
+ */
+struct cmd_entry *cmd_queue_head(struct cmd_queue *q) {
+	if (q->next == q->head) {
+		return NULL;
+	}
+	return CMD_ENTRY(q, q->head);
+}
+
+/*
+ * request sent last, NULL when none is outstanding
+ */
+struct cmd_entry *cmd_queue_last_sent(struct cmd_queue *q) {
+	if (q->next == q->head) {
+		return NULL;
+	}
+	return CMD_ENTRY(q, q->next - 1);
+}
+
+/*
+ * a response frame
+ * Returns the request it answers, NULL for a frame nobody waits for
+ * (a late answer to an earlier command). A request is done when all its
+ * frames are in or the sensor answered with an error, the next one then
+ * starts its wait.
+ */
+struct cmd_entry *cmd_queue_answer(struct cmd_queue *q, const uint8_t *frame) {
+	struct cmd_entry *e;
+
+	if (q->next == q->head) {
+		return NULL;
+	}
+	e = CMD_ENTRY(q, q->head);
+	if (frame[5] != e->frame[5] || frame[6] != e->frame[6]) {
+		return NULL;
+	}
+
+	// error response (Table72 command | 0x80)
+	if (frame[4] & 0x80) {
+		e->received = e->responses;
+	} else {
+		e->received++;
+	}
+	if (e->received >= e->responses) {
+		q->head++;
+		if (q->next != q->head) {
+			CMD_ENTRY(q, q->head)->sent_ns = stats_now_ns();
+		}
+	}
+	return e;
+}
+
+/*
+ * send everything not fully answered again
+ */
+void cmd_queue_rewind(struct cmd_queue *q) {
+	q->next = q->head;
+	if (q->head != q->tail) {
+		CMD_ENTRY(q, q->head)->received = 0;
+	}
+}
+
+/*
+ * requests not fully answered
+ */
+unsigned int cmd_queue_pending(struct cmd_queue *q) {
+	return q->tail - q->head;
+}
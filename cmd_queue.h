@@ -0,0 +1,81 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CMD_QUEUE__
+#define __CMD_QUEUE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_QUEUE_LEN		(4)	// queued requests, a power of two
+#define CMD_FRAME_MAX		(20)	// longest request frame
+#define CMD_PIPELINE_DEPTH	(2)	// requests on the wire at once with overlap on
+
+/*
+ * one request and the frames answering it
+ */
+struct cmd_entry {
+	uint8_t frame[CMD_FRAME_MAX];
+	size_t len;
+	uint32_t responses;		// frames it is answered with
+	uint32_t received;
+	uint64_t sent_ns;		// sent, or the request before it finished
+};
+
+/*
+ * command scheduler of one serial link
+ * Requests are queued in order and the sensor answers them in order.
+ * The next one is sent while nothing is outstanding, or once the answer
+ * to the one before it has come far enough (the caller tells, e.g. its
+ * header is in): the sensor has taken that command by then and finds the
+ * next one waiting when it is done, so the link does not sit idle for a
+ * round trip in between. At most CMD_PIPELINE_DEPTH requests are on the
+ * wire.
+ * The overlap is off unless cmd_queue_overlap_set() turns it on: it is
+ * only checked against the emulator, not that the sensor keeps a request
+ * arriving while it still sends. Off, a request goes out once the one
+ * before it is fully answered.
+ */
+struct cmd_queue {
+	struct cmd_entry entries[CMD_QUEUE_LEN];
+	unsigned int head;		// oldest request not fully answered
+	unsigned int next;		// next request to send
+	unsigned int tail;		// end of the queue
+};
+
+void cmd_queue_overlap_set(int enable);
+
+void cmd_queue_init(struct cmd_queue *q);
+
+struct cmd_entry *cmd_queue_add(struct cmd_queue *q, size_t len, uint32_t responses);
+
+struct cmd_entry *cmd_queue_ready(struct cmd_queue *q, int started);
+
+void cmd_queue_sent(struct cmd_queue *q, uint64_t now_ns);
+
+struct cmd_entry *cmd_queue_head(struct cmd_queue *q);
+
+struct cmd_entry *cmd_queue_last_sent(struct cmd_queue *q);
+
+struct cmd_entry *cmd_queue_answer(struct cmd_queue *q, const uint8_t *frame);
+
+void cmd_queue_rewind(struct cmd_queue *q);
+
+unsigned int cmd_queue_pending(struct cmd_queue *q);
+
+#endif /* __CMD_QUEUE__ */
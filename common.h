@@ -19,15 +19,20 @@
 #ifndef __COMMON__
 #define __COMMON__
 
+#include <stdint.h>
+
 // output data mode
 #define MODE_LATEST		(0)
 #define MODE_MEMDATA		(1)
-#define MAX_MODE_NUM		(1)
+#define MODE_DAEMON		(2)
+#define MAX_MODE_NUM		(2)
 
 // #define DEBUG		
 
 // constant
 #define SERIAL_BAUDRATE		(B115200)
+#define DEFAULT_INTERVAL_MS	(1000)	// daemon mode polling interval
+#define MIN_INTERVAL_MS		(100)
 
 struct senser_data_t {
 	float temp;
@@ -41,4 +46,62 @@ struct senser_data_t {
 	float heat;
 };
 
+// raw values as sent by the sensor (Table 84)
+struct sensor_raw_t {
+	int32_t temp;		// 0.01 degC
+	int32_t humid;		// 0.01 %RH
+	int32_t light;		// 1 lx
+	int32_t press;		// 0.001 hPa
+	int32_t noise;		// 0.01 dB
+	int32_t TVOC;		// 1 ppb
+	int32_t CO2;		// 1 ppm
+	int32_t discom;		// 0.01
+	int32_t heat;		// 0.01 degC
+};
+
+#define SAMPLE_FLAG_MEMORY	(0x0001)	// time_ms is the device time counter
+#define SAMPLE_FLAG_SENSOR_ERROR	(0x0002)	// the error status register reported a fault
+#define SAMPLE_FLAG_ABSENT(f)	(0x0080 << (f))	// field f was not read (register_map.h)
+#define SAMPLE_FLAGS_ABSENT	(0xff80)
+
+// sensor_raw_t fields in order
+#define FIELD_TEMP		(0)
+#define FIELD_HUMID		(1)
+#define FIELD_LIGHT		(2)
+#define FIELD_PRESS		(3)
+#define FIELD_NOISE		(4)
+#define FIELD_TVOC		(5)
+#define FIELD_CO2		(6)
+#define FIELD_DISCOM		(7)
+#define FIELD_HEAT		(8)
+#define SENSOR_FIELDS		(9)
+#define FIELDS_ALL		((1 << SENSOR_FIELDS) - 1)
+
+// one decoded sample
+struct sensor_sample_t {
+	uint64_t time_ms;	// unix time, or device time counter for memory data
+	uint16_t device_id;
+	uint16_t flags;
+	struct sensor_raw_t raw;
+};
+
+#define SENSOR_BATCH_MAX	(128)	// records per batch, one memory data window
+
+// decoded records in columns, one array per field
+struct sensor_batch {
+	uint32_t count;
+	uint16_t device_id;
+	uint16_t flags;
+	uint64_t time_ms[SENSOR_BATCH_MAX];
+	int32_t temp[SENSOR_BATCH_MAX];
+	int32_t humid[SENSOR_BATCH_MAX];
+	int32_t light[SENSOR_BATCH_MAX];
+	int32_t press[SENSOR_BATCH_MAX];
+	int32_t noise[SENSOR_BATCH_MAX];
+	int32_t TVOC[SENSOR_BATCH_MAX];
+	int32_t CO2[SENSOR_BATCH_MAX];
+	int32_t discom[SENSOR_BATCH_MAX];
+	int32_t heat[SENSOR_BATCH_MAX];
+};
+
 #endif /* __MAIN__ */
@@ -0,0 +1,85 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "crc16.h"
+#include "crc16_table.h"
+
+/*
+ * crc16 bit Calc
+ * Reference implementation, one bit per iteration.
+ */
+unsigned short crc16_bit_calc(const unsigned char *ptr, int len) {
+	int i,j;
+	unsigned short crc = CRC_INIT;
+	for (i = 0; i < len; i++) {
+		crc ^= ptr[i];
+		for (j=0; j < 8; j++) {
+			if (crc & 1) {
+				crc = (crc >> 1) ^ CRC16POLY;
+			} else {
+				crc >>= 1;
+			}
+		}
+	}
+	return crc;
+}
+
+/*
+ * crc16 table Calc
+ * One table lookup per byte.
+ */
+unsigned short crc16_table_calc(const unsigned char *ptr, int len) {
+	int i;
+	unsigned short crc = CRC_INIT;
+	for (i = 0; i < len; i++) {
+		crc = (crc >> 8) ^ crc16_table[0][(crc ^ ptr[i]) & 0xff];
+	}
+	return crc;
+}
+
+/*
+ * crc16 slice-by-8 Calc
+ * Eight bytes per iteration with independent lookups, tail by table.
+ */
+unsigned short crc16_slice8_calc(const unsigned char *ptr, int len) {
+	unsigned short crc = CRC_INIT;
+
+	while (len >= 8) {
+		crc ^= ptr[0] | (ptr[1] << 8);
+		crc = crc16_table[7][crc & 0xff] ^ crc16_table[6][crc >> 8] ^
+		      crc16_table[5][ptr[2]] ^ crc16_table[4][ptr[3]] ^
+		      crc16_table[3][ptr[4]] ^ crc16_table[2][ptr[5]] ^
+		      crc16_table[1][ptr[6]] ^ crc16_table[0][ptr[7]];
+		ptr += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = (crc >> 8) ^ crc16_table[0][(crc ^ *ptr++) & 0xff];
+	}
+	return crc;
+}
+
+/*
+ * crc16 Calc
+ */
+unsigned short crc16_calc(const unsigned char *ptr, int len) {
+	if (len >= CRC16_SLICE_MIN_LEN) {
+		return crc16_slice8_calc(ptr, len);
+	}
+	return crc16_table_calc(ptr, len);
+}
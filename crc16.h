@@ -0,0 +1,37 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CRC16__
+#define __CRC16__
+
+//crc16 format
+#define CRC16POLY               (0xa001)
+#define CRC_INIT                (0xffff)
+
+// buffers at least this long go through the slice-by-8 engine
+#define CRC16_SLICE_MIN_LEN     (16)
+
+unsigned short crc16_bit_calc(const unsigned char *ptr, int len);
+
+unsigned short crc16_table_calc(const unsigned char *ptr, int len);
+
+unsigned short crc16_slice8_calc(const unsigned char *ptr, int len);
+
+unsigned short crc16_calc(const unsigned char *ptr, int len);
+
+#endif /* __CRC16__ */
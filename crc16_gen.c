@@ -0,0 +1,64 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+
+#include "crc16.h"
+
+/*
+ * crc16 table generator
+ * Built with the host compiler and run at build time to emit crc16_table.h.
+ * Row 0 is the classic byte-wise table, row k advances row k-1 by one more
+ * zero byte, which is what the slice-by-8 engine needs.
+ */
+int main(void) {
+	static unsigned short table[8][256];
+	unsigned short crc;
+	int i, j, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			if (crc & 1) {
+				crc = (crc >> 1) ^ CRC16POLY;
+			} else {
+				crc >>= 1;
+			}
+		}
+		table[0][i] = crc;
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			crc = table[k - 1][i];
+			table[k][i] = (crc >> 8) ^ table[0][crc & 0xff];
+		}
+	}
+
+	printf("/* generated by crc16_gen.c, do not edit */\n\n");
+	printf("static const unsigned short crc16_table[8][256] = {\n");
+	for (k = 0; k < 8; k++) {
+		printf("\t{\n");
+		for (i = 0; i < 256; i++) {
+			printf("%s0x%04x,%s", (i % 8) ? " " : "\t\t", table[k][i], (i % 8 == 7) ? "\n" : "");
+		}
+		printf("\t},\n");
+	}
+	printf("};\n");
+
+	return 0;
+}
@@ -18,21 +18,472 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "common.h"
+#include "data_output.h"
+
+static int output_format = OUTPUT_CSV;
+static unsigned output_fields = FIELDS_ALL;
+
+/*
+ * output format select
+ */
+void output_format_set(int format) {
+	output_format = format;
+}
+
+int output_format_get(void) {
+	return output_format;
+}
+
+/*
+ * output field select, a FIELD_ mask
+ */
+void output_fields_set(unsigned fields) {
+	output_fields = fields;
+}
+
+unsigned output_fields_get(void) {
+	return output_fields;
+}
+
+static struct {
+	sample_sink_fn fn;
+	void *ctx;
+} sinks[MAX_SINKS];
+static int sink_count;
+
+/*
+ * sample sink register
+ */
+int output_sink_add(sample_sink_fn fn, void *ctx) {
+	if (sink_count >= MAX_SINKS) {
+		fprintf(stderr, "too many sample sinks.\n");
+		return -1;
+	}
+	sinks[sink_count].fn = fn;
+	sinks[sink_count].ctx = ctx;
+	sink_count++;
+	return 0;
+}
+
+/*
+ * sample sink publish
+ */
+void output_sink_publish(const struct sensor_sample_t *sample) {
+	int i;
+
+	for (i = 0; i < sink_count; i++) {
+		sinks[i].fn(sinks[i].ctx, sample);
+	}
+}
+
+static struct {
+	batch_sink_fn fn;
+	void *ctx;
+} batch_sinks[MAX_SINKS];
+static int batch_sink_count;
+
+/*
+ * batch sink register
+ */
+int output_batch_sink_add(batch_sink_fn fn, void *ctx) {
+	if (batch_sink_count >= MAX_SINKS) {
+		fprintf(stderr, "too many batch sinks.\n");
+		return -1;
+	}
+	batch_sinks[batch_sink_count].fn = fn;
+	batch_sinks[batch_sink_count].ctx = ctx;
+	batch_sink_count++;
+	return 0;
+}
+
+/*
+ * batch sink publish
+ */
+void output_batch_sink_publish(const struct sensor_batch *b) {
+	int i;
+
+	for (i = 0; i < batch_sink_count; i++) {
+		batch_sinks[i].fn(batch_sinks[i].ctx, b);
+	}
+}
+
+/*
+ * fixed point put
+ * Same text as printf("%<width>.<digits>f", value / 10^digits) without
+ * going through a float.
+ */
+char *fixed_put(char *p, int32_t value, int digits, int width) {
+	char tmp[16];
+	uint32_t v;
+	int n = 0;
+
+	v = value < 0 ? -(uint32_t)value : (uint32_t)value;
+
+	// reversed: fraction, point, integer part, sign
+	while (n < digits) {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	}
+	if (digits) {
+		tmp[n++] = '.';
+	}
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (value < 0) {
+		tmp[n++] = '-';
+	}
+
+	while (width-- > n) {
+		*p++ = ' ';
+	}
+	while (n) {
+		*p++ = tmp[--n];
+	}
+	return p;
+}
+
+/*
+ * csv format
+ * Formats one record into buf (at least CSV_LINE_MAX bytes), returns its
+ * length. With all columns the text matches the former
+ * "%5.2f,%5.2f,%d,%8.3lf,%5.2f,%d,%d,%5.2f,%5.2f\n" output, a field
+ * the sample does not carry is left empty.
+ */
+#define CSV_FIELD(f, value, digits, width)				\
+	if (columns & (1 << (f))) {					\
+		if (!(flags & SAMPLE_FLAG_ABSENT(f))) {			\
+			p = fixed_put(p, value, digits, width);		\
+		}							\
+		*p++ = ',';						\
+	}
+
+int csv_format(char *buf, const char *tag, const struct sensor_sample_t *sample, unsigned columns) {
+	const struct sensor_raw_t *raw = &sample->raw;
+	uint16_t flags = sample->flags;
+	char *p = buf;
+
+	if (tag != NULL) {
+		while (*tag && p < buf + CSV_TAG_MAX) {
+			*p++ = *tag++;
+		}
+		*p++ = ',';
+	}
+	CSV_FIELD(FIELD_TEMP, raw->temp, 2, 5);
+	CSV_FIELD(FIELD_HUMID, raw->humid, 2, 5);
+	CSV_FIELD(FIELD_LIGHT, raw->light, 0, 0);
+	CSV_FIELD(FIELD_PRESS, raw->press, 3, 8);
+	CSV_FIELD(FIELD_NOISE, raw->noise, 2, 5);
+	CSV_FIELD(FIELD_TVOC, raw->TVOC, 0, 0);
+	CSV_FIELD(FIELD_CO2, raw->CO2, 0, 0);
+	CSV_FIELD(FIELD_DISCOM, raw->discom, 2, 5);
+	CSV_FIELD(FIELD_HEAT, raw->heat, 2, 5);
+	p[-1] = '\n';
+
+	return (int)(p - buf);
+}
+
+/*
+ * little-endian put
+ */
+static uint8_t *put_le(uint8_t *p, uint64_t value, int bytes) {
+	while (bytes--) {
+		*p++ = value & 0xff;
+		value >>= 8;
+	}
+	return p;
+}
+
+/*
+ * binary format
+ * Formats one BIN_RECORD_LEN record into buf, returns its length.
+ */
+int bin_format(uint8_t *buf, const struct sensor_sample_t *sample) {
+	const struct sensor_raw_t *raw = &sample->raw;
+	uint8_t *p = buf;
+
+	p = put_le(p, sample->time_ms, 8);
+	p = put_le(p, sample->device_id, 2);
+	p = put_le(p, sample->flags, 2);
+	p = put_le(p, (uint32_t)raw->temp, 2);
+	p = put_le(p, (uint32_t)raw->humid, 2);
+	p = put_le(p, (uint32_t)raw->light, 2);
+	p = put_le(p, (uint32_t)raw->press, 4);
+	p = put_le(p, (uint32_t)raw->noise, 2);
+	p = put_le(p, (uint32_t)raw->TVOC, 2);
+	p = put_le(p, (uint32_t)raw->CO2, 2);
+	p = put_le(p, (uint32_t)raw->discom, 2);
+	p = put_le(p, (uint32_t)raw->heat, 2);
+
+	return (int)(p - buf);
+}
+
+/*
+ * little-endian get
+ */
+static uint64_t get_le(const uint8_t *p, int bytes) {
+	uint64_t value = 0;
+
+	while (bytes--) {
+		value = (value << 8) | p[bytes];
+	}
+	return value;
+}
+
+/*
+ * binary parse
+ * Reads one BIN_RECORD_LEN record back, the reverse of bin_format().
+ */
+void bin_parse(const uint8_t *buf, struct sensor_sample_t *sample) {
+	struct sensor_raw_t *raw = &sample->raw;
+
+	sample->time_ms = get_le(buf, 8);
+	sample->device_id = get_le(buf + 8, 2);
+	sample->flags = get_le(buf + 10, 2);
+	raw->temp = get_le(buf + 12, 2);
+	raw->humid = get_le(buf + 14, 2);
+	raw->light = get_le(buf + 16, 2);
+	raw->press = (int32_t)get_le(buf + 18, 4);
+	raw->noise = get_le(buf + 22, 2);
+	raw->TVOC = get_le(buf + 24, 2);
+	raw->CO2 = get_le(buf + 26, 2);
+	raw->discom = get_le(buf + 28, 2);
+	raw->heat = get_le(buf + 30, 2);
+}
+
+/*
+ * csv format of batch record i
+ * Same output as csv_format(), read straight from the columns.
+ */
+int csv_batch_format(char *buf, const char *tag, const struct sensor_batch *b, uint32_t i, unsigned columns) {
+	uint16_t flags = b->flags;
+	char *p = buf;
+
+	if (tag != NULL) {
+		while (*tag && p < buf + CSV_TAG_MAX) {
+			*p++ = *tag++;
+		}
+		*p++ = ',';
+	}
+	CSV_FIELD(FIELD_TEMP, b->temp[i], 2, 5);
+	CSV_FIELD(FIELD_HUMID, b->humid[i], 2, 5);
+	CSV_FIELD(FIELD_LIGHT, b->light[i], 0, 0);
+	CSV_FIELD(FIELD_PRESS, b->press[i], 3, 8);
+	CSV_FIELD(FIELD_NOISE, b->noise[i], 2, 5);
+	CSV_FIELD(FIELD_TVOC, b->TVOC[i], 0, 0);
+	CSV_FIELD(FIELD_CO2, b->CO2[i], 0, 0);
+	CSV_FIELD(FIELD_DISCOM, b->discom[i], 2, 5);
+	CSV_FIELD(FIELD_HEAT, b->heat[i], 2, 5);
+	p[-1] = '\n';
+
+	return (int)(p - buf);
+}
+
+/*
+ * binary format of batch record i
+ */
+int bin_batch_format(uint8_t *buf, const struct sensor_batch *b, uint32_t i) {
+	uint8_t *p = buf;
+
+	p = put_le(p, b->time_ms[i], 8);
+	p = put_le(p, b->device_id, 2);
+	p = put_le(p, b->flags, 2);
+	p = put_le(p, (uint32_t)b->temp[i], 2);
+	p = put_le(p, (uint32_t)b->humid[i], 2);
+	p = put_le(p, (uint32_t)b->light[i], 2);
+	p = put_le(p, (uint32_t)b->press[i], 4);
+	p = put_le(p, (uint32_t)b->noise[i], 2);
+	p = put_le(p, (uint32_t)b->TVOC[i], 2);
+	p = put_le(p, (uint32_t)b->CO2[i], 2);
+	p = put_le(p, (uint32_t)b->discom[i], 2);
+	p = put_le(p, (uint32_t)b->heat[i], 2);
+
+	return (int)(p - buf);
+}
+
+// wire widths of the fields in FIELD_ order
+static const int field_bytes[SENSOR_FIELDS] = { 2, 2, 2, 4, 2, 2, 2, 2, 2 };
+
+/*
+ * binary record length holding the fields of a FIELD_ mask
+ */
+static int bin_record_len(unsigned fields) {
+	int len = BIN_RECORD_LEN - BIN_FIELDS_LEN;
+	int f;
+
+	for (f = 0; f < SENSOR_FIELDS; f++) {
+		if (fields & (1 << f)) {
+			len += field_bytes[f];
+		}
+	}
+	return len;
+}
+
+/*
+ * projected binary format
+ * The bin_format() layout without the fields outside the mask, v holds
+ * all nine in FIELD_ order.
+ */
+static int bin_project(uint8_t *buf, uint64_t time_ms, uint16_t device_id, uint16_t flags,
+		       const int32_t *v, unsigned fields) {
+	uint8_t *p = buf;
+	int f;
+
+	p = put_le(p, time_ms, 8);
+	p = put_le(p, device_id, 2);
+	p = put_le(p, flags, 2);
+	for (f = 0; f < SENSOR_FIELDS; f++) {
+		if (fields & (1 << f)) {
+			p = put_le(p, (uint32_t)v[f], field_bytes[f]);
+		}
+	}
+
+	return (int)(p - buf);
+}
+
+/*
+ * data writer init
+ */
+void data_writer_init(struct data_writer *w, FILE *fp) {
+	w->fp = fp;
+	w->format = output_format;
+	w->fields = output_fields;
+	w->len = 0;
+}
+
+/*
+ * data writer flush
+ */
+int data_writer_flush(struct data_writer *w) {
+	int ret = 0;
+
+	if (w->len && fwrite(w->buf, 1, w->len, w->fp) != w->len) {
+		perror("write");
+		ret = -1;
+	}
+	w->len = 0;
+	if (fflush(w->fp)) {
+		ret = -1;
+	}
+	return ret;
+}
 
 /*
  * header output
+ * The csv column names, or the binary file header.
  */
-void header_output(FILE *fd) {
-	fprintf(fd, "Temperature, Relative humidity, Ambient light, Barometric pressure, Sound noise, eTVOC, eCO2, Discomfort index, Heat stroke\n");
+void header_output(struct data_writer *w, int tagged) {
+	static const char *const columns[SENSOR_FIELDS] = {
+		"Temperature", "Relative humidity", "Ambient light", "Barometric pressure",
+		"Sound noise", "eTVOC", "eCO2", "Discomfort index", "Heat stroke",
+	};
+	uint8_t *p;
+	int f, count = 0;
+
+	data_writer_flush(w);
+
+	for (f = 0; f < SENSOR_FIELDS; f++) {
+		count += !!(w->fields & (1 << f));
+	}
+
+	if (w->format == OUTPUT_BIN) {
+		// a projected file says which fields its records hold
+		p = (uint8_t *)w->buf;
+		memcpy(p, BIN_MAGIC, 4);
+		p = put_le(p + 4, w->fields == FIELDS_ALL ? BIN_VERSION : BIN_VERSION_FIELDS, 2);
+		p = put_le(p, BIN_HEADER_LEN, 2);
+		p = put_le(p, bin_record_len(w->fields), 2);
+		p = put_le(p, count, 2);
+		p = put_le(p, w->fields == FIELDS_ALL ? 0 : w->fields, 4);
+		w->len = BIN_HEADER_LEN;
+		return;
+	}
+
+	if (tagged) {
+		memcpy(w->buf, "Device, ", 8);
+		w->len = 8;
+	}
+	for (f = 0; f < SENSOR_FIELDS; f++) {
+		if (w->fields & (1 << f)) {
+			w->len += sprintf(w->buf + w->len, "%s%s", columns[f], --count ? ", " : "\n");
+		}
+	}
+}
+
+/*
+ * header match
+ * Whether the file of the writer starts with the header header_output()
+ * gives, so records in the format and fields of the writer can be
+ * appended. The file is left positioned at its end.
+ */
+int header_match(struct data_writer *w, int tagged) {
+	char head[CSV_LINE_MAX];
+	size_t len;
+	int match;
+
+	header_output(w, tagged);
+	len = w->len;
+	w->len = 0;
+
+	match = len <= sizeof(head) && fseek(w->fp, 0, SEEK_SET) == 0 &&
+		fread(head, 1, len, w->fp) == len && memcmp(head, w->buf, len) == 0;
+	fseek(w->fp, 0, SEEK_END);
+	return match;
 }
 
 /*
  * usb data output
  */
-void usb_data_output(FILE *fd, struct senser_data_t sensor_data) {
-	fprintf(fd,"%5.2f,%5.2f,%d,%8.3lf,%5.2f,%d,%d,%5.2f,%5.2f\n",
-		sensor_data.temp, sensor_data.humid, sensor_data.light, sensor_data.press,
-		sensor_data.noise, sensor_data.TVOC, sensor_data.CO2, sensor_data.discom, sensor_data.heat);
+void usb_data_output(struct data_writer *w, const char *tag, const struct sensor_sample_t *sample) {
+	const struct sensor_raw_t *raw = &sample->raw;
+
+	if (w->len + CSV_LINE_MAX > OUTPUT_BUF_LEN) {
+		data_writer_flush(w);
+	}
+	if (w->format != OUTPUT_BIN) {
+		w->len += csv_format(w->buf + w->len, tag, sample, w->fields);
+	} else if (w->fields == FIELDS_ALL) {
+		w->len += bin_format((uint8_t *)w->buf + w->len, sample);
+	} else {
+		const int32_t v[SENSOR_FIELDS] = {
+			raw->temp, raw->humid, raw->light, raw->press, raw->noise,
+			raw->TVOC, raw->CO2, raw->discom, raw->heat,
+		};
+
+		w->len += bin_project((uint8_t *)w->buf + w->len, sample->time_ms, sample->device_id,
+				      sample->flags, v, w->fields);
+	}
+}
+
+/*
+ * batch output
+ * The whole batch is formatted into the writer buffer, flushing only
+ * when it is full.
+ */
+void usb_batch_output(struct data_writer *w, const char *tag, const struct sensor_batch *b) {
+	uint32_t i;
+
+	for (i = 0; i < b->count; i++) {
+		if (w->len + CSV_LINE_MAX > OUTPUT_BUF_LEN) {
+			data_writer_flush(w);
+		}
+		if (w->format != OUTPUT_BIN) {
+			w->len += csv_batch_format(w->buf + w->len, tag, b, i, w->fields);
+		} else if (w->fields == FIELDS_ALL) {
+			w->len += bin_batch_format((uint8_t *)w->buf + w->len, b, i);
+		} else {
+			const int32_t v[SENSOR_FIELDS] = {
+				b->temp[i], b->humid[i], b->light[i], b->press[i], b->noise[i],
+				b->TVOC[i], b->CO2[i], b->discom[i], b->heat[i],
+			};
+
+			w->len += bin_project((uint8_t *)w->buf + w->len, b->time_ms[i], b->device_id,
+					      b->flags, v, w->fields);
+		}
+	}
 }
@@ -19,10 +19,91 @@
 #ifndef __DATA_OUTPUT__
 #define __DATA_OUTPUT__
 
+#include <stdio.h>
+
 #include "common.h"
 
-void header_output(FILE *fd);
+// output format
+#define OUTPUT_CSV		(0)
+#define OUTPUT_BIN		(1)
+
+#define OUTPUT_BUF_LEN		(16 * 1024)
+#define CSV_LINE_MAX		(160)	// longest formatted record incl. device tag
+#define CSV_TAG_MAX		(32)
+
+// binary file layout, all values little-endian
+//   header : magic "2JCB", version u16, header length u16,
+//            record length u16, field count u16, reserved u32
+//   record : time_ms u64, device id u16, flags u16, then the nine
+//            Table 84 fields with their wire widths (20 bytes),
+//            fields flagged absent (SAMPLE_FLAG_ABSENT) are zero
+// A file written with an output field selection is version 2, its
+// reserved word holds the FIELD_ mask and the records only those fields.
+#define BIN_MAGIC		"2JCB"
+#define BIN_VERSION		(1)
+#define BIN_VERSION_FIELDS	(2)
+#define BIN_HEADER_LEN		(16)
+#define BIN_RECORD_LEN		(32)
+#define BIN_FIELDS_LEN		(20)
+#define BIN_FIELD_COUNT		(9)
+
+#define MAX_SINKS		(8)
+
+// receives every sample collected from the devices
+typedef void (*sample_sink_fn)(void *ctx, const struct sensor_sample_t *sample);
+
+// receives every memory data batch
+typedef void (*batch_sink_fn)(void *ctx, const struct sensor_batch *b);
+
+/*
+ * records are formatted into buf and handed to stdio a block at a time
+ */
+struct data_writer {
+	FILE *fp;
+	int format;
+	unsigned fields;	// FIELD_ mask of the columns written
+	size_t len;
+	char buf[OUTPUT_BUF_LEN];
+};
+
+void output_format_set(int format);
+
+int output_format_get(void);
+
+void output_fields_set(unsigned fields);
+
+unsigned output_fields_get(void);
+
+int output_sink_add(sample_sink_fn fn, void *ctx);
+
+void output_sink_publish(const struct sensor_sample_t *sample);
+
+int output_batch_sink_add(batch_sink_fn fn, void *ctx);
+
+void output_batch_sink_publish(const struct sensor_batch *b);
+
+char *fixed_put(char *p, int32_t value, int digits, int width);
+
+int csv_format(char *buf, const char *tag, const struct sensor_sample_t *sample, unsigned columns);
+
+int bin_format(uint8_t *buf, const struct sensor_sample_t *sample);
+
+void bin_parse(const uint8_t *buf, struct sensor_sample_t *sample);
+
+int csv_batch_format(char *buf, const char *tag, const struct sensor_batch *b, uint32_t i, unsigned columns);
+
+int bin_batch_format(uint8_t *buf, const struct sensor_batch *b, uint32_t i);
+
+void data_writer_init(struct data_writer *w, FILE *fp);
+
+int data_writer_flush(struct data_writer *w);
+
+void header_output(struct data_writer *w, int tagged);
+
+int header_match(struct data_writer *w, int tagged);
+
+void usb_data_output(struct data_writer *w, const char *tag, const struct sensor_sample_t *sample);
 
-void usb_data_output(FILE *fd, struct senser_data_t sensor_data);
+void usb_batch_output(struct data_writer *w, const char *tag, const struct sensor_batch *b);
 
 #endif
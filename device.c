@@ -0,0 +1,249 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <termios.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "device.h"
+
+/*
+ * init usb serial
+ */
+static int init_serial(int fd, struct termios *old_tio) {
+	int ret;
+	struct termios tio;
+
+	ret = tcgetattr(fd, old_tio);
+	if (ret) {
+		perror("tcgetattr");
+		return -1;
+	}
+
+	// new serial conf
+	memset(&tio, 0, sizeof(tio));
+
+	tio.c_iflag = IGNBRK | IGNPAR;
+	tio.c_cflag = CS8 | CLOCAL | CREAD;
+	ret = cfsetspeed(&tio, SERIAL_BAUDRATE);
+	if (ret < 0) {
+		perror("cfsetspeed");
+		return -1;
+	}
+
+	ret = tcflush(fd, TCIFLUSH);
+	if (ret < 0) {
+		perror("tcflush");
+		return -1;
+	}
+
+	// new serial conf set
+	ret = tcsetattr(fd, TCSANOW, &tio);
+	if (ret < 0) {
+		perror("tcsetattr");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * restore serial
+ */
+static void restore_serial(int fd, struct termios *old_tio) {
+	int ret;
+
+	ret = tcsetattr(fd, TCSANOW, old_tio);
+	if (ret < 0) {
+		perror("tcsetattr");
+	}
+}
+
+/*
+ * Find out name to use for lockfile when locking tty.
+ */
+static char *dev_lockname(char *dev_name, char *res, int res_len) {
+	char *temp;
+
+	if (strncmp(dev_name, "/dev/", 5) == 0) {
+		// In dev
+		strncpy(res, dev_name + 5, res_len - 1);
+		res[res_len - 1] = 0;
+		for (temp = res; *temp; temp++) {
+			if (*temp == '/') {
+				*temp = '_';
+			}
+		}
+	} else {
+		// Outside of dev
+		if ((temp = strrchr(dev_name, '/')) == NULL ) {
+			temp = dev_name;
+		} else {
+			temp++;
+		}
+		strncpy(res, temp, res_len - 1);
+		res[res_len - 1] = 0;
+	}
+	return res;
+}
+
+/*
+ * port lock
+ */
+static int lock_device(struct sensor_device *dev) {
+	char lockbuf[127];
+	int lock_check;
+	int old_mask;
+
+	snprintf(dev->lockfile, sizeof(dev->lockfile), "/var/lock/LCK..%s", dev_lockname(dev->name, lockbuf, sizeof(lockbuf)));
+	if ((dev->lock_fd = open(dev->lockfile, O_RDONLY)) >= 0) {
+		lock_check = read(dev->lock_fd, lockbuf, sizeof(lockbuf));
+		close(dev->lock_fd);
+		if (lock_check > 0) {
+			// Lockfile is stale
+			unlink(dev->lockfile);
+		} else if (lock_check == 0) {
+			// Device is locked
+			fprintf(stderr, "Device %s is locked.\n", dev->name);
+			return -1;
+		}
+	}
+
+	old_mask = umask(022);
+	dev->lock_fd = open(dev->lockfile, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	umask(old_mask);
+	if (dev->lock_fd < 0) {
+		perror("lockfile");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * device list expand
+ * <device> is a comma separated list, every entry may be a glob pattern
+ * such as "/dev/ttyUSB*". Returns the number of names, -1 on error.
+ */
+int device_expand(char *arg, char **names, int max) {
+	char *entry, *save;
+	glob_t g;
+	size_t i;
+	int count = 0;
+
+	for (entry = strtok_r(arg, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+		if (strpbrk(entry, "*?[") == NULL) {
+			if (count >= max) {
+				fprintf(stderr, "too many devices.\n");
+				return -1;
+			}
+			names[count++] = entry;
+			continue;
+		}
+
+		if (glob(entry, 0, NULL, &g) != 0) {
+			fprintf(stderr, "no device matches %s.\n", entry);
+			continue;
+		}
+		for (i = 0; i < g.gl_pathc; i++) {
+			if (count >= max) {
+				fprintf(stderr, "too many devices.\n");
+				globfree(&g);
+				return -1;
+			}
+			// the names outlive the glob, they are used until exit
+			names[count++] = strdup(g.gl_pathv[i]);
+		}
+		globfree(&g);
+	}
+	return count;
+}
+
+/*
+ * device open
+ */
+int device_open(struct sensor_device *dev, char *name, int id) {
+	int ret;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->id = id;
+	dev->name = name;
+	snprintf(dev->label, sizeof(dev->label), "%s", basename(name));
+	link_retry_init(&dev->retry, (unsigned int)time(NULL) ^ (id << 16));
+	cmd_queue_init(&dev->cmds);
+	dev->status = -1;
+	dev->table = register_table_default();
+
+	// USB port open
+	dev->fd = open(name, O_RDWR | O_NOCTTY);
+	if (dev->fd < 0) {
+		perror("port open");
+		return -1;
+	}
+
+	// serial port conf
+	ret = init_serial(dev->fd, &dev->tio);
+	if (ret) {
+		perror("serial");
+		goto exit_close;
+	}
+
+	// frame reader on the port
+	ret = frame_reader_init(&dev->reader, dev->fd);
+	if (ret) {
+		goto exit_restore;
+	}
+
+	ret = lock_device(dev);
+	if (ret) {
+		goto exit_restore;
+	}
+	return 0;
+
+exit_restore:
+	restore_serial(dev->fd, &dev->tio);
+exit_close:
+	close(dev->fd);
+	dev->fd = -1;
+	return -1;
+}
+
+/*
+ * device close
+ */
+void device_close(struct sensor_device *dev) {
+	if (dev->fd < 0) {
+		return;
+	}
+	close(dev->lock_fd);
+	unlink(dev->lockfile);
+	restore_serial(dev->fd, &dev->tio);
+	close(dev->fd);
+	dev->fd = -1;
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DEVICE__
+#define __DEVICE__
+
+#include <termios.h>
+
+#include "cmd_queue.h"
+#include "frame_reader.h"
+#include "link_retry.h"
+#include "register_map.h"
+#include "stats.h"
+
+#define MAX_DEVICES		(64)
+#define DEVICE_LABEL_LEN	(32)
+
+/*
+ * one opened 2JCIE-BU port
+ */
+struct sensor_device {
+	int id;				// position in the device list
+	char *name;			// device path
+	char label[DEVICE_LABEL_LEN];	// device path basename, tags samples
+	const char *tag;		// label when several devices are collected
+	int fd;
+	int lock_fd;
+	char lockfile[144];	// "/var/lock/LCK.." and up to 126 bytes of name
+	struct termios tio;
+	struct frame_reader reader;
+	struct cmd_queue cmds;
+	struct link_stats stats;
+	struct link_retry retry;
+	int status;			// error status register, -1 unknown, -2 not supported
+	const struct register_table *table;	// latest data register read
+};
+
+int device_expand(char *arg, char **names, int max);
+
+int device_open(struct sensor_device *dev, char *name, int id);
+
+void device_close(struct sensor_device *dev);
+
+#endif /* __DEVICE__ */
@@ -0,0 +1,649 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * 2JCIE-BU emulator
+ * Opens a pseudo-terminal and answers the commands used by 2jcie-bu01
+ * (latest data 0x5022, memory index 0x5004, memory data 0x500F, error
+ * status 0x5401) with
+ * correctly CRC'd frames, so the collector can be run and measured
+ * without the USB sensor. Memory records are synthesized from their
+ * index, any number of them can be announced.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "crc16.h"
+
+#define HEADER_LOW		(0x52)
+#define HEADER_HIGH		(0x42)
+#define CMD_READ		(0x01)	// Table72
+#define CMD_ERROR		(0x80)	// or'ed into the command of an error response
+
+#define LATEST_ADDR		(0x5022)	// Table84
+#define SENSING_ADDR		(0x5012)	// latest sensing data
+#define CALC_ADDR		(0x5013)	// latest calculation data, Table 100
+#define CALC_LEN		(17)		// discomfort index, heat stroke, vibration
+#define INFO_ADDR		(0x5004)
+#define MEMORY_ADDR		(0x500F)
+#define STATUS_ADDR		(0x5401)
+
+#define ERR_CRC			(0x01)	// error codes of an error response
+#define ERR_COMMAND		(0x02)
+#define ERR_ADDRESS		(0x03)
+#define ERR_LENGTH		(0x04)
+
+#define DATA_LEN		(20)	// Table84 sensing data
+#define MEMDATA_FRAME_LEN	(41)
+#define RX_BUF_LEN		(1024)
+#define RX_LOG_LEN		(16)
+#define TX_BUF_LEN		(64 * 1024)
+
+struct emulator {
+	int master;
+	uint32_t records;	// memory index of the latest record
+	uint32_t oldest;	// memory index of the oldest record
+	long interval;		// seconds between memory records
+	uint64_t base_time;	// time counter of memory index 0
+	long latency_ms;	// delay before each response
+	int fragment;		// response bytes per write, 0 for whole responses
+	long gap_us;		// delay between fragments
+	unsigned long corrupt;	// every n-th response frame gets a broken crc
+	unsigned long frames;	// response frames sent
+	uint8_t status;		// error status register
+	uint8_t seq;		// latest data sequence number
+	uint8_t rx[RX_BUF_LEN];
+	size_t rx_len;
+	struct {
+		size_t end;		// rx_len after a read
+		long long usec;		// when it was read
+	} rx_log[RX_LOG_LEN];
+	int rx_log_len;
+	uint8_t tx[TX_BUF_LEN];
+	size_t tx_len;
+};
+
+static volatile sig_atomic_t terminated;
+
+static void sig_handler(int sig) {
+	(void)sig;
+	terminated = 1;
+}
+
+static void usage(char *basename) {
+	printf("usage: %s [options]\n\n", basename);
+	printf(
+		"2JCIE-BU emulator on a pseudo-terminal. The slave path is printed on start,\n"
+		"give it to 2jcie-bu01 as the device.\n"
+		"\n"
+		"options:\n"
+		"  -n, --records <n>     : Memory records held by the emulated sensor. (default 1000)\n"
+		"  -o, --oldest <index>  : Memory index of the oldest record. (default 1)\n"
+		"  -t, --interval <sec>  : Time counter step between memory records. (default 300)\n"
+		"  -l, --latency <msec>  : Delay between a request and its response. A request\n"
+		"                          sent during a response is read right away, its delay\n"
+		"                          runs while that response is still sent.\n"
+		"  -F, --fragment <n>    : Write responses n bytes at a time.\n"
+		"  -g, --gap <usec>      : Delay between fragments. (default 1000)\n"
+		"  -c, --corrupt <n>     : Break the crc of every n-th response frame.\n"
+		"  -s, --status <bits>   : Error status register value. (default 0)\n"
+		"  -L, --link <path>     : Also make a symlink to the slave at path.\n");
+}
+
+static const struct option long_options[] = {
+	{ "records",	required_argument,	NULL,	'n' },
+	{ "oldest",	required_argument,	NULL,	'o' },
+	{ "interval",	required_argument,	NULL,	't' },
+	{ "latency",	required_argument,	NULL,	'l' },
+	{ "fragment",	required_argument,	NULL,	'F' },
+	{ "gap",	required_argument,	NULL,	'g' },
+	{ "corrupt",	required_argument,	NULL,	'c' },
+	{ "status",	required_argument,	NULL,	's' },
+	{ "link",	required_argument,	NULL,	'L' },
+	{ "help",	no_argument,		NULL,	'h' },
+	{ NULL,		0,			NULL,	0 },
+};
+
+/*
+ * sleep for usec
+ */
+static void sleep_us(long usec) {
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !terminated)
+		;
+}
+
+/*
+ * monotonic time in usec
+ */
+static long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * read pending request bytes
+ * Each read is logged with its time, a request counts as arrived when
+ * its last byte is in.
+ */
+static int read_input(struct emulator *emu) {
+	ssize_t len;
+
+	len = read(emu->master, emu->rx + emu->rx_len, RX_BUF_LEN - emu->rx_len);
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return 0;
+		}
+		perror("read");
+		return -1;
+	}
+	emu->rx_len += len;
+	if (emu->rx_log_len == RX_LOG_LEN) {
+		emu->rx_log_len--;
+	}
+	emu->rx_log[emu->rx_log_len].end = emu->rx_len;
+	emu->rx_log[emu->rx_log_len].usec = now_us();
+	emu->rx_log_len++;
+	return 0;
+}
+
+/*
+ * read requests sent while a response goes out
+ */
+static int poll_input(struct emulator *emu) {
+	struct pollfd pfd;
+
+	pfd.fd = emu->master;
+	pfd.events = POLLIN;
+	if (emu->rx_len < RX_BUF_LEN && poll(&pfd, 1, 0) > 0) {
+		return read_input(emu);
+	}
+	return 0;
+}
+
+/*
+ * arrival time of the request ending at rx offset end
+ */
+static long long arrival_us(struct emulator *emu, size_t end) {
+	int i;
+
+	for (i = 0; i < emu->rx_log_len - 1 && emu->rx_log[i].end < end; i++) {
+		;
+	}
+	return emu->rx_log[i].usec;
+}
+
+/*
+ * drop the first n rx bytes from the log
+ */
+static void rx_log_consume(struct emulator *emu, size_t n) {
+	int i, j = 0;
+
+	for (i = 0; i < emu->rx_log_len; i++) {
+		if (emu->rx_log[i].end > n) {
+			emu->rx_log[j].end = emu->rx_log[i].end - n;
+			emu->rx_log[j].usec = emu->rx_log[i].usec;
+			j++;
+		}
+	}
+	emu->rx_log_len = j;
+}
+
+/*
+ * write all of buf to the pty
+ */
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR && !terminated) {
+				continue;
+			}
+			perror("write");
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * send queued responses
+ */
+static int flush_tx(struct emulator *emu) {
+	size_t pos, len;
+	int ret = 0;
+
+	if (emu->tx_len == 0) {
+		return 0;
+	}
+	if (emu->fragment <= 0) {
+		ret = write_all(emu->master, emu->tx, emu->tx_len);
+	} else {
+		for (pos = 0; pos < emu->tx_len && ret == 0; pos += len) {
+			len = emu->tx_len - pos;
+			if (len > (size_t)emu->fragment) {
+				len = emu->fragment;
+			}
+			if (pos > 0 && emu->gap_us > 0) {
+				sleep_us(emu->gap_us);
+			}
+			if (poll_input(emu)) {
+				return -1;
+			}
+			ret = write_all(emu->master, emu->tx + pos, len);
+		}
+	}
+	emu->tx_len = 0;
+	return ret;
+}
+
+/*
+ * queue one response frame
+ * payload is the command, address and data, header and crc are added.
+ */
+static int put_frame(struct emulator *emu, const uint8_t *payload, int len) {
+	uint8_t *frame;
+	unsigned short crc16;
+
+	if (emu->tx_len + len + 6 > TX_BUF_LEN && flush_tx(emu)) {
+		return -1;
+	}
+	frame = emu->tx + emu->tx_len;
+	frame[0] = HEADER_LOW;
+	frame[1] = HEADER_HIGH;
+	frame[2] = (len + 2) & 0xff;
+	frame[3] = (len + 2) >> 8;
+	memcpy(frame + 4, payload, len);
+
+	crc16 = crc16_calc(frame, len + 4);
+	emu->frames++;
+	if (emu->corrupt && emu->frames % emu->corrupt == 0) {
+		crc16 ^= 0x5a5a;
+	}
+	frame[len + 4] = crc16 & 0xff;
+	frame[len + 5] = crc16 >> 8;
+
+	emu->tx_len += len + 6;
+	return 0;
+}
+
+/*
+ * little endian store
+ */
+static void put_le(uint8_t *p, uint64_t value, int bytes) {
+	int i;
+
+	for (i = 0; i < bytes; i++) {
+		p[i] = value >> (i * 8);
+	}
+}
+
+/*
+ * synthesized Table84 data
+ * Slow ramps derived from n so a dump shows plausible, checkable values.
+ */
+static void sensing_data(uint8_t *p, uint32_t n) {
+	put_le(p + 0, 2000 + n % 1000, 2);		// temperature 0.01 degC
+	put_le(p + 2, 4000 + n % 2000, 2);		// relative humidity 0.01 %RH
+	put_le(p + 4, 300 + n % 500, 2);		// ambient light lx
+	put_le(p + 6, 1000000 + n % 30000, 4);		// barometric pressure 0.001 hPa
+	put_le(p + 10, 4000 + n % 3000, 2);		// sound noise 0.01 dB
+	put_le(p + 12, n % 200, 2);			// eTVOC ppb
+	put_le(p + 14, 400 + n % 1000, 2);		// eCO2 ppm
+	put_le(p + 16, 6000 + n % 2000, 2);		// discomfort index 0.01
+	put_le(p + 18, 1500 + n % 1000, 2);		// heat stroke 0.01 degC
+}
+
+/*
+ * error response
+ */
+static int put_error(struct emulator *emu, uint8_t comm, unsigned short addr, uint8_t code) {
+	uint8_t payload[4];
+
+	payload[0] = comm | CMD_ERROR;
+	put_le(payload + 1, addr, 2);
+	payload[3] = code;
+	return put_frame(emu, payload, sizeof(payload));
+}
+
+/*
+ * 0x5022, 0x5012 and 0x5013 latest data
+ * Cut from the Table84 values: 0x5012 carries the first 16 bytes,
+ * 0x5013 the last 4 and the vibration values, zero for a sensor at rest.
+ */
+static int latest_data(struct emulator *emu, uint8_t comm, unsigned short addr) {
+	uint8_t payload[4 + DATA_LEN];	// the longest of the three
+	uint8_t data[DATA_LEN];
+	int len;
+
+	payload[0] = comm;
+	put_le(payload + 1, addr, 2);
+	payload[3] = ++emu->seq;
+	sensing_data(data, (uint32_t)time(NULL));
+	memset(payload + 4, 0, CALC_LEN);
+	if (addr == SENSING_ADDR) {
+		len = 16;
+		memcpy(payload + 4, data, len);
+	} else if (addr == CALC_ADDR) {
+		len = CALC_LEN;
+		memcpy(payload + 4, data + 16, 4);
+	} else {
+		len = DATA_LEN;
+		memcpy(payload + 4, data, len);
+	}
+	return put_frame(emu, payload, 4 + len);
+}
+
+/*
+ * 0x5004 latest/oldest memory index
+ */
+static int memory_info(struct emulator *emu, uint8_t comm, unsigned short addr) {
+	uint8_t payload[11];
+
+	payload[0] = comm;
+	put_le(payload + 1, addr, 2);
+	put_le(payload + 3, emu->records, 4);
+	put_le(payload + 7, emu->oldest, 4);
+	return put_frame(emu, payload, sizeof(payload));
+}
+
+/*
+ * 0x5401 error status
+ */
+static int error_status(struct emulator *emu, uint8_t comm, unsigned short addr) {
+	uint8_t payload[4];
+
+	payload[0] = comm;
+	put_le(payload + 1, addr, 2);
+	payload[3] = emu->status;
+	return put_frame(emu, payload, sizeof(payload));
+}
+
+/*
+ * 0x500F memory data, one frame per record
+ */
+static int memory_data(struct emulator *emu, uint8_t comm, unsigned short addr, const uint8_t *frame, int len) {
+	uint8_t payload[MEMDATA_FRAME_LEN - 6];
+	uint32_t start, end, index;
+
+	if (len != 17) {
+		return put_error(emu, comm, addr, ERR_LENGTH);
+	}
+	start = frame[7] | (frame[8] << 8) | (frame[9] << 16) | ((uint32_t)frame[10] << 24);
+	end = frame[11] | (frame[12] << 8) | (frame[13] << 16) | ((uint32_t)frame[14] << 24);
+	if (start > end || start < emu->oldest || end > emu->records) {
+		return put_error(emu, comm, addr, ERR_ADDRESS);
+	}
+
+	payload[0] = comm;
+	put_le(payload + 1, addr, 2);
+	for (index = start; ; index++) {
+		put_le(payload + 3, index, 4);
+		put_le(payload + 7, emu->base_time + (uint64_t)index * emu->interval, 8);
+		sensing_data(payload + 15, index);
+		if (put_frame(emu, payload, sizeof(payload))) {
+			return -1;
+		}
+		if (index == end) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * answer one request frame
+ */
+static int handle_frame(struct emulator *emu, const uint8_t *frame, int len, long long arrived_us) {
+	unsigned short crc16, addr;
+	uint8_t comm;
+	long long wait_us;
+
+	comm = frame[4];
+	addr = frame[5] | (frame[6] << 8);
+	crc16 = frame[len - 2] | (frame[len - 1] << 8);
+	if (crc16_calc(frame, len - 2) != crc16) {
+		return put_error(emu, comm, addr, ERR_CRC);
+	}
+	if (comm != CMD_READ) {
+		return put_error(emu, comm, addr, ERR_COMMAND);
+	}
+
+	wait_us = arrived_us + emu->latency_ms * 1000 - now_us();
+	if (wait_us > 0) {
+		sleep_us(wait_us);
+	}
+
+	switch (addr) {
+	case LATEST_ADDR:
+	case SENSING_ADDR:
+	case CALC_ADDR:
+		return latest_data(emu, comm, addr);
+	case INFO_ADDR:
+		return memory_info(emu, comm, addr);
+	case MEMORY_ADDR:
+		return memory_data(emu, comm, addr, frame, len);
+	case STATUS_ADDR:
+		return error_status(emu, comm, addr);
+	default:
+		return put_error(emu, comm, addr, ERR_ADDRESS);
+	}
+}
+
+/*
+ * split received bytes into request frames
+ * Bytes before a header are dropped, like the sensor does.
+ */
+static int handle_input(struct emulator *emu) {
+	size_t pos = 0;
+	int len;
+
+	while (emu->rx_len - pos >= 4) {
+		if (emu->rx[pos] != HEADER_LOW || emu->rx[pos + 1] != HEADER_HIGH) {
+			pos++;
+			continue;
+		}
+		len = 4 + (emu->rx[pos + 2] | (emu->rx[pos + 3] << 8));
+		if (len < 9 || len > RX_BUF_LEN) {
+			pos++;
+			continue;
+		}
+		if (emu->rx_len - pos < (size_t)len) {
+			break;
+		}
+		if (handle_frame(emu, emu->rx + pos, len, arrival_us(emu, pos + len)) || flush_tx(emu)) {
+			return -1;
+		}
+		pos += len;
+	}
+
+	memmove(emu->rx, emu->rx + pos, emu->rx_len - pos);
+	emu->rx_len -= pos;
+	rx_log_consume(emu, pos);
+	return 0;
+}
+
+/*
+ * open the pseudo-terminal pair
+ * The slave stays open here as well, so the master does not see a
+ * hangup between two runs of the collector.
+ */
+static int open_pty(int *master, int *slave, char *name, size_t name_len) {
+	struct termios tio;
+
+	*master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (*master < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	if (grantpt(*master) < 0 || unlockpt(*master) < 0 ||
+	    ptsname_r(*master, name, name_len) != 0) {
+		perror("pty");
+		close(*master);
+		return -1;
+	}
+
+	*slave = open(name, O_RDWR | O_NOCTTY);
+	if (*slave < 0) {
+		perror(name);
+		close(*master);
+		return -1;
+	}
+	if (tcgetattr(*slave, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(*slave, TCSANOW, &tio);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	static struct emulator emu;
+	struct sigaction sa;
+	struct pollfd pfd;
+	char name[64];
+	char *link_path = NULL;
+	unsigned long value;
+	char *end;
+	int slave, opt, ret = 0;
+
+	emu.records = 1000;
+	emu.oldest = 1;
+	emu.interval = 300;
+	emu.gap_us = 1000;
+
+	while ((opt = getopt_long(argc, argv, "n:o:t:l:F:g:c:s:L:h", long_options, NULL)) != -1) {
+		if (opt == 'L') {
+			link_path = optarg;
+			continue;
+		}
+		if (opt == 'h' || opt == '?') {
+			usage(basename(argv[0]));
+			return opt == 'h' ? 0 : 1;
+		}
+		errno = 0;
+		value = strtoul(optarg, &end, 0);
+		if (errno || *end != '\0' || value > UINT32_MAX) {
+			printf("invalid value: -%c %s\n", opt, optarg);
+			return 1;
+		}
+		switch (opt) {
+		case 'n':
+			emu.records = value;
+			break;
+		case 'o':
+			emu.oldest = value;
+			break;
+		case 't':
+			emu.interval = value;
+			break;
+		case 'l':
+			emu.latency_ms = value;
+			break;
+		case 'F':
+			emu.fragment = value;
+			break;
+		case 'g':
+			emu.gap_us = value;
+			break;
+		case 'c':
+			emu.corrupt = value;
+			break;
+		case 's':
+			emu.status = value;
+			break;
+		}
+	}
+	if (emu.oldest == 0 || emu.oldest > emu.records) {
+		printf("oldest index must be in 1..records.\n");
+		return 1;
+	}
+	emu.base_time = (uint64_t)time(NULL) - (uint64_t)emu.records * emu.interval;
+
+	if (open_pty(&emu.master, &slave, name, sizeof(name))) {
+		return 1;
+	}
+	if (link_path != NULL) {
+		unlink(link_path);
+		if (symlink(name, link_path) < 0) {
+			perror(link_path);
+			link_path = NULL;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	pfd.fd = emu.master;
+	pfd.events = POLLIN;
+	while (!terminated) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			ret = 1;
+			break;
+		}
+		if (read_input(&emu) || handle_input(&emu)) {
+			ret = 1;
+			break;
+		}
+		// a full buffer without a frame is garbage
+		if (emu.rx_len == RX_BUF_LEN) {
+			emu.rx_len = 0;
+			emu.rx_log_len = 0;
+		}
+	}
+
+	if (link_path != NULL) {
+		unlink(link_path);
+	}
+	close(slave);
+	close(emu.master);
+	return ret;
+}
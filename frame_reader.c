@@ -0,0 +1,285 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "crc16.h"
+#include "frame_reader.h"
+#include "sensor_data.h"
+
+#define MAX_POLL_FDS		(128)
+#define MAX_DEVICE_FDS		(64)
+#define MAX_POLL_HOOKS		(4)
+
+static struct poll_hook *hooks[MAX_POLL_HOOKS];
+static int hook_count;
+
+/*
+ * poll hook register
+ */
+int frame_reader_add_hook(struct poll_hook *hook) {
+	if (hook_count >= MAX_POLL_HOOKS) {
+		fprintf(stderr, "too many poll hooks.\n");
+		return -1;
+	}
+	hooks[hook_count++] = hook;
+	return 0;
+}
+
+/*
+ * init frame reader
+ * The port is switched to non-blocking mode, reads only happen once
+ * poll() reports data.
+ */
+int frame_reader_init(struct frame_reader *fr, int fd) {
+	int flags;
+
+	memset(fr, 0, sizeof(*fr));
+	fr->fd = fd;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * drop buffered bytes
+ */
+void frame_reader_reset(struct frame_reader *fr) {
+	fr->pos = 0;
+	fr->len = 0;
+}
+
+/*
+ * start the deadline of the next frame
+ */
+void frame_reader_arm(struct frame_reader *fr, long timeout_ms) {
+	clock_gettime(CLOCK_MONOTONIC, &fr->deadline);
+	fr->deadline.tv_sec += timeout_ms / 1000;
+	fr->deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (fr->deadline.tv_nsec >= 1000000000L) {
+		fr->deadline.tv_sec++;
+		fr->deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * msec left until the deadline, 0 when expired
+ */
+long frame_reader_remaining_ms(struct frame_reader *fr) {
+	struct timespec now;
+	long msec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msec = (fr->deadline.tv_sec - now.tv_sec) * 1000 +
+		(fr->deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return msec > 0 ? msec : 0;
+}
+
+/*
+ * bytes of an incomplete frame
+ */
+size_t frame_reader_partial(struct frame_reader *fr) {
+	return fr->len - fr->pos;
+}
+
+/*
+ * read available bytes
+ * Returns bytes read, 0 when nothing is pending, -1 on error.
+ */
+int frame_reader_fill(struct frame_reader *fr) {
+	ssize_t ret;
+
+	// keep the unconsumed tail at the head of the buffer
+	if (fr->pos > 0) {
+		memmove(fr->buf, fr->buf + fr->pos, fr->len - fr->pos);
+		fr->len -= fr->pos;
+		fr->pos = 0;
+	}
+	if (fr->len == FRAME_BUF_LEN) {
+		return 0;
+	}
+
+	for (;;) {
+		ret = read(fr->fd, fr->buf + fr->len, FRAME_BUF_LEN - fr->len);
+		if (ret < 0) {
+			if (errno == EINTR && !is_terminated()) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			perror("read");
+			fr->failed = 1;
+			return -1;
+		}
+		if (ret == 0) {
+			fprintf(stderr, "device %d closed.\n", fr->fd);
+			fr->failed = 1;
+			return -1;
+		}
+		fr->len += ret;
+		fr->bytes_read += ret;
+		return (int)ret;
+	}
+}
+
+/*
+ * next complete frame
+ * Returns 1 and points *frame into the reader buffer (valid until the next
+ * fill) when a frame with a good crc16 is available, 0 otherwise.
+ */
+int frame_reader_next(struct frame_reader *fr, uint8_t **frame, size_t *len) {
+	uint8_t *p;
+	size_t avail, flen;
+	unsigned short crc16, checkcrc;
+
+	for (;;) {
+		avail = fr->len - fr->pos;
+		p = fr->buf + fr->pos;
+
+		// resync on header
+		if (avail >= 1 && p[0] != FRAME_HEADER_LOW) {
+			p = memchr(p, FRAME_HEADER_LOW, avail);
+			flen = p ? (size_t)(p - (fr->buf + fr->pos)) : avail;
+			fr->pos += flen;
+			fr->discarded += flen;
+			continue;
+		}
+		if (avail < FRAME_HEADER_LEN) {
+			return 0;
+		}
+		flen = FRAME_HEADER_LEN + (p[2] | (p[3] << 8));
+		if (p[1] != FRAME_HEADER_HIGH || flen < FRAME_MIN_LEN || flen > FRAME_MAX_LEN) {
+			fr->pos++;
+			fr->discarded++;
+			continue;
+		}
+		if (avail < flen) {
+			return 0;
+		}
+
+		// crc16 check. A bad frame may hide the real header, so only
+		// one byte is skipped.
+		crc16 = crc16_calc(p, flen - 2);
+		checkcrc = p[flen - 1] << 8 | p[flen - 2];
+		if (crc16 != checkcrc) {
+			fprintf(stderr, "crc16 check failed.\n");
+			fr->crc_errors++;
+			fr->pos++;
+			fr->discarded++;
+			continue;
+		}
+
+		fr->pos += flen;
+		fr->frames++;
+		*frame = p;
+		*len = flen;
+		return 1;
+	}
+}
+
+/*
+ * wait for the next frame until the armed deadline
+ */
+int frame_reader_wait(struct frame_reader *fr, uint8_t **frame, size_t *len) {
+	long msec;
+
+	for (;;) {
+		if (frame_reader_next(fr, frame, len)) {
+			return FRAME_READY;
+		}
+
+		msec = frame_reader_remaining_ms(fr);
+		if (msec == 0) {
+			if (frame_reader_partial(fr)) {
+				fprintf(stderr, "CAUTION: time out. partial frame %zu bytes.\n", frame_reader_partial(fr));
+			} else {
+				fprintf(stderr, "CAUTION: time out.\n");
+			}
+			return FRAME_TIMEOUT;
+		}
+
+		if (frame_reader_poll(&fr, 1, msec) < 0 || fr->failed) {
+			return FRAME_ERROR;
+		}
+	}
+}
+
+/*
+ * wait on several ports at once
+ * Every reader with pending input is filled. Returns the number of
+ * readers that received bytes, 0 on timeout, -1 on error. A port that
+ * fails is marked and left out, the others keep going. Registered poll
+ * hooks are served on the way, with no readers this is an idle wait.
+ */
+int frame_reader_poll(struct frame_reader **readers, int count, long timeout_ms) {
+	struct pollfd pfds[MAX_POLL_FDS];
+	int hook_base[MAX_POLL_HOOKS + 1];
+	int i, ret, nfds, filled = 0;
+
+	if (count > MAX_DEVICE_FDS) {
+		count = MAX_DEVICE_FDS;
+	}
+	for (i = 0; i < count; i++) {
+		pfds[i].fd = (readers[i] && !readers[i]->failed) ? readers[i]->fd : -1;
+		pfds[i].events = POLLIN;
+		pfds[i].revents = 0;
+	}
+	nfds = count;
+	for (i = 0; i < hook_count; i++) {
+		hook_base[i] = nfds;
+		nfds += hooks[i]->prepare(hooks[i]->ctx, pfds + nfds, MAX_POLL_FDS - nfds);
+	}
+	hook_base[hook_count] = nfds;
+
+	do {
+		ret = poll(pfds, nfds, (int)timeout_ms);
+	} while (ret < 0 && errno == EINTR && !is_terminated());
+	if (ret < 0) {
+		if (errno != EINTR) {
+			perror("poll");
+		}
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+			if (frame_reader_fill(readers[i]) > 0) {
+				filled++;
+			}
+		}
+	}
+	for (i = 0; i < hook_count; i++) {
+		if (hook_base[i + 1] > hook_base[i]) {
+			hooks[i]->dispatch(hooks[i]->ctx, pfds + hook_base[i], hook_base[i + 1] - hook_base[i]);
+		}
+	}
+	return filled;
+}
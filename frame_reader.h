@@ -0,0 +1,92 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FRAME_READER__
+#define __FRAME_READER__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+
+// frame format
+#define FRAME_HEADER_LOW	(0x52)
+#define FRAME_HEADER_HIGH	(0x42)
+#define FRAME_HEADER_LEN	(4)	// header + length field
+#define FRAME_MIN_LEN		(FRAME_HEADER_LEN + 6)	// command, address, error code, crc16
+#define FRAME_MAX_LEN		(256)
+
+#define FRAME_BUF_LEN		(1024)
+#define FRAME_TIMEOUT_MS	(1000)	// per frame deadline
+
+// frame_reader_wait() result
+#define FRAME_READY		(1)
+#define FRAME_TIMEOUT		(0)
+#define FRAME_ERROR		(-1)
+
+/*
+ * Reassembles response frames from a non-blocking serial stream.
+ * Bytes that cannot start a valid frame are dropped until the next
+ * 0x52 0x42 header, and frames failing the crc16 check are skipped.
+ */
+struct frame_reader {
+	int fd;
+	uint8_t buf[FRAME_BUF_LEN];
+	size_t pos;			// first unconsumed byte
+	size_t len;			// end of valid data
+	struct timespec deadline;	// current frame deadline (CLOCK_MONOTONIC)
+	unsigned long discarded;	// bytes dropped while resynchronising
+	unsigned long crc_errors;
+	uint64_t bytes_read;
+	uint64_t frames;		// good frames returned
+	int failed;			// read error, the port is skipped by poll
+};
+
+/*
+ * other descriptors served from the same poll() as the ports, so one
+ * thread drives the devices and e.g. network clients together.
+ * prepare() fills at most max entries and returns how many it used,
+ * dispatch() gets them back with revents set.
+ */
+struct poll_hook {
+	int (*prepare)(void *ctx, struct pollfd *pfds, int max);
+	void (*dispatch)(void *ctx, struct pollfd *pfds, int count);
+	void *ctx;
+};
+
+int frame_reader_add_hook(struct poll_hook *hook);
+
+int frame_reader_init(struct frame_reader *fr, int fd);
+
+void frame_reader_reset(struct frame_reader *fr);
+
+void frame_reader_arm(struct frame_reader *fr, long timeout_ms);
+
+long frame_reader_remaining_ms(struct frame_reader *fr);
+
+size_t frame_reader_partial(struct frame_reader *fr);
+
+int frame_reader_fill(struct frame_reader *fr);
+
+int frame_reader_next(struct frame_reader *fr, uint8_t **frame, size_t *len);
+
+int frame_reader_wait(struct frame_reader *fr, uint8_t **frame, size_t *len);
+
+int frame_reader_poll(struct frame_reader **readers, int count, long timeout_ms);
+
+#endif /* __FRAME_READER__ */
@@ -0,0 +1,1206 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
+#include "common.h"
+#include "data_output.h"
+#include "http_server.h"
+#include "ring_file.h"
+#include "rollup.h"
+#include "stats.h"
+
+#define HTTP_BACKLOG		(16)
+#define HTTP_SAMPLE_JSON_MAX	(256)	// longest sample object
+#define HTTP_BUCKET_JSON_MAX	(1024)	// longest rollup bucket object
+#define HTTP_MAX_POINTS		(10000)	// largest /history?points= budget
+#define SAMPLE_FIELDS		(9)
+#define HTTP_INDEX		"/2jcie.html"
+
+/*
+ * response body under construction
+ */
+struct http_buf {
+	char *p;
+	size_t len;
+	size_t cap;
+};
+
+/*
+ * buffer reserve
+ * Returns room for at least n more bytes, NULL when out of memory.
+ */
+static char *buf_reserve(struct http_buf *b, size_t n) {
+	char *p;
+	size_t cap;
+
+	if (b->len + n > b->cap) {
+		cap = b->cap ? b->cap : 4096;
+		while (cap < b->len + n) {
+			cap *= 2;
+		}
+		p = realloc(b->p, cap);
+		if (p == NULL) {
+			return NULL;
+		}
+		b->p = p;
+		b->cap = cap;
+	}
+	return b->p + b->len;
+}
+
+static int buf_append(struct http_buf *b, const char *s, size_t n) {
+	char *p = buf_reserve(b, n);
+
+	if (p == NULL) {
+		return -1;
+	}
+	memcpy(p, s, n);
+	b->len += n;
+	return 0;
+}
+
+// the nine fields in sensor_raw_t order, with their JSON names
+static const struct {
+	const char *name;
+	int digits;
+} sample_fields[SAMPLE_FIELDS] = {
+	{ "temp", 2 }, { "humid", 2 }, { "light", 0 }, { "press", 3 }, { "noise", 2 },
+	{ "tvoc", 0 }, { "co2", 0 }, { "discom", 2 }, { "heat", 2 },
+};
+
+/*
+ * sample fields in sample_fields order
+ */
+static void sample_values(const struct sensor_raw_t *raw, int32_t *v) {
+	v[0] = raw->temp;
+	v[1] = raw->humid;
+	v[2] = raw->light;
+	v[3] = raw->press;
+	v[4] = raw->noise;
+	v[5] = raw->TVOC;
+	v[6] = raw->CO2;
+	v[7] = raw->discom;
+	v[8] = raw->heat;
+}
+
+/*
+ * sample to JSON object
+ * A field the sample does not carry is null.
+ */
+static int json_sample(struct http_buf *b, struct http_server *srv, const struct sensor_sample_t *s) {
+	const char *name = "";
+	int32_t v[SAMPLE_FIELDS];
+	char *start, *p;
+	int f;
+
+	start = p = buf_reserve(b, HTTP_SAMPLE_JSON_MAX);
+	if (p == NULL) {
+		return -1;
+	}
+	if (s->device_id < srv->dev_count) {
+		name = srv->devs[s->device_id].label;
+	}
+
+	p += snprintf(p, 96, "{\"device\":\"%.*s\",\"id\":%u,\"time\":%" PRIu64,
+		      DEVICE_LABEL_LEN, name, s->device_id, s->time_ms);
+	sample_values(&s->raw, v);
+	for (f = 0; f < SAMPLE_FIELDS; f++) {
+		*p++ = ',';
+		*p++ = '"';
+		p = stpcpy(p, sample_fields[f].name);
+		*p++ = '"';
+		*p++ = ':';
+		if (s->flags & SAMPLE_FLAG_ABSENT(f)) {
+			p = stpcpy(p, "null");
+		} else {
+			p = fixed_put(p, v[f], sample_fields[f].digits, 0);
+		}
+	}
+	*p++ = '}';
+
+	b->len += p - start;
+	return 0;
+}
+
+/*
+ * /latest
+ */
+static int build_latest(struct http_server *srv, struct http_buf *b) {
+	int i, first = 1;
+
+	buf_append(b, "[", 1);
+	for (i = 0; i < srv->dev_count; i++) {
+		if (!srv->has_latest[i]) {
+			continue;
+		}
+		if (!first && buf_append(b, ",", 1)) {
+			return -1;
+		}
+		if (json_sample(b, srv, &srv->latest[i])) {
+			return -1;
+		}
+		first = 0;
+	}
+	return buf_append(b, "]", 1);
+}
+
+/*
+ * stored samples of one device in [since, until]
+ * Walks the ring file when one is attached, it reaches back days, and the
+ * in-memory history otherwise.
+ */
+struct sample_iter {
+	struct http_server *srv;
+	uint64_t pos;
+	uint64_t end;
+	long device;
+	uint64_t since;
+	uint64_t until;
+};
+
+static void sample_at(struct http_server *srv, uint64_t n, struct sensor_sample_t *s) {
+	struct ring_header *hdr;
+
+	if (srv->ring != NULL) {
+		hdr = srv->ring->hdr;
+		bin_parse(srv->ring->records + (n % hdr->capacity) * BIN_RECORD_LEN, s);
+	} else {
+		*s = srv->history[n % HTTP_HISTORY_LEN];
+	}
+}
+
+static void sample_iter_start(struct sample_iter *it, struct http_server *srv,
+			      long device, uint64_t since, uint64_t until) {
+	struct sensor_sample_t s;
+	uint64_t lo, hi, mid;
+
+	it->srv = srv;
+	it->device = device;
+	it->since = since;
+	it->until = until;
+	if (srv->ring != NULL) {
+		it->pos = srv->ring->hdr->tail;
+		it->end = srv->ring->hdr->head;
+	} else {
+		it->pos = srv->history_count > HTTP_HISTORY_LEN ? srv->history_count - HTTP_HISTORY_LEN : 0;
+		it->end = srv->history_count;
+	}
+
+	// samples are stored in time order, skip to the first one >= since
+	lo = it->pos;
+	hi = it->end;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		sample_at(srv, mid, &s);
+		if (s.time_ms < since) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	it->pos = lo;
+}
+
+static int sample_iter_next(struct sample_iter *it, struct sensor_sample_t *s) {
+	while (it->pos < it->end) {
+		sample_at(it->srv, it->pos++, s);
+		if (s->time_ms > it->until) {
+			it->pos = it->end;
+			break;
+		}
+		if (s->time_ms >= it->since && (it->device < 0 || s->device_id == it->device)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * largest-triangle-three-buckets downsampling
+ * Picks at most points samples per field out of the count samples the
+ * iterator yields. The first and the last sample are kept, every bucket
+ * in between contributes the sample spanning the largest triangle with
+ * the previously picked one and the average of the next bucket. Three
+ * passes over the stored samples (count, bucket averages, pick), so no
+ * copy of the range is made.
+ */
+struct lttb_point {
+	uint64_t t;
+	int32_t v;
+};
+
+static int lttb(struct sample_iter *range, int count, int points, unsigned fields,
+		struct lttb_point *out[SAMPLE_FIELDS]) {
+	struct sample_iter it;
+	struct sensor_sample_t s;
+	double *avg_t, (*avg_v)[SAMPLE_FIELDS], area, best[SAMPLE_FIELDS];
+	double at, av, ct, cv, span;
+	int32_t v[SAMPLE_FIELDS];
+	int buckets = points - 2;
+	int j, k, f, next;
+
+	avg_t = calloc(buckets, sizeof(*avg_t));
+	avg_v = calloc(buckets, sizeof(*avg_v));
+	if (avg_t == NULL || avg_v == NULL) {
+		free(avg_t);
+		free(avg_v);
+		return -1;
+	}
+
+	// bucket k holds samples [1 + k * (count - 2) / buckets, 1 + (k + 1) * (count - 2) / buckets)
+	it = *range;
+	for (j = 0, k = -1, next = 1; sample_iter_next(&it, &s) && j < count; j++) {
+		sample_values(&s.raw, v);
+		if (j == 0 || j == count - 1) {
+			for (f = 0; f < SAMPLE_FIELDS; f++) {
+				out[f][j == 0 ? 0 : points - 1] = (struct lttb_point){ s.time_ms, v[f] };
+			}
+			continue;
+		}
+		while (j >= next) {
+			k++;
+			next = 1 + (int)((int64_t)(k + 1) * (count - 2) / buckets);
+		}
+		avg_t[k] += s.time_ms;
+		for (f = 0; f < SAMPLE_FIELDS; f++) {
+			avg_v[k][f] += v[f];
+		}
+	}
+	for (k = 0; k < buckets; k++) {
+		span = (int)((int64_t)(k + 1) * (count - 2) / buckets) - (int)((int64_t)k * (count - 2) / buckets);
+		avg_t[k] /= span;
+		for (f = 0; f < SAMPLE_FIELDS; f++) {
+			avg_v[k][f] /= span;
+		}
+	}
+
+	it = *range;
+	sample_iter_next(&it, &s);
+	for (j = 1, k = -1, next = 1; j < count - 1 && sample_iter_next(&it, &s); j++) {
+		while (j >= next) {
+			k++;
+			next = 1 + (int)((int64_t)(k + 1) * (count - 2) / buckets);
+			for (f = 0; f < SAMPLE_FIELDS; f++) {
+				best[f] = -1;
+			}
+		}
+		sample_values(&s.raw, v);
+		for (f = 0; f < SAMPLE_FIELDS; f++) {
+			if (!(fields & (1u << f))) {
+				continue;
+			}
+			// times relative to the picked point keep the doubles exact
+			at = 0;
+			av = out[f][k].v;
+			ct = (k + 1 < buckets ? avg_t[k + 1] : (double)out[f][points - 1].t) - (double)out[f][k].t;
+			cv = k + 1 < buckets ? avg_v[k + 1][f] : out[f][points - 1].v;
+			area = fabs((at - ct) * (v[f] - av) - (at - ((double)s.time_ms - out[f][k].t)) * (cv - av));
+			if (area > best[f]) {
+				best[f] = area;
+				out[f][k + 1] = (struct lttb_point){ s.time_ms, v[f] };
+			}
+		}
+	}
+
+	free(avg_t);
+	free(avg_v);
+	return 0;
+}
+
+/*
+ * /history?points=<n>&since=&until=&device=&fields=temp,humid
+ * One series of at most n points per field, {"temp":[[msec,value],...],...}
+ * Only fields every sample of the range carries get a series.
+ */
+static int build_downsampled(struct http_buf *b, struct sample_iter *range,
+			     int points, unsigned fields) {
+	struct lttb_point *out[SAMPLE_FIELDS] = { NULL };
+	struct sample_iter it;
+	struct sensor_sample_t s;
+	int32_t v[SAMPLE_FIELDS];
+	int count = 0, n, f, j, ret = -1;
+	char *start, *p;
+
+	it = *range;
+	while (sample_iter_next(&it, &s)) {
+		for (f = 0; f < SAMPLE_FIELDS; f++) {
+			if (s.flags & SAMPLE_FLAG_ABSENT(f)) {
+				fields &= ~(1u << f);
+			}
+		}
+		count++;
+	}
+	n = count < points ? count : points;
+
+	for (f = 0; f < SAMPLE_FIELDS; f++) {
+		out[f] = malloc((n > 0 ? n : 1) * sizeof(struct lttb_point));
+		if (out[f] == NULL) {
+			goto exit_free;
+		}
+	}
+
+	if (count <= points) {
+		it = *range;
+		for (j = 0; j < count && sample_iter_next(&it, &s); j++) {
+			sample_values(&s.raw, v);
+			for (f = 0; f < SAMPLE_FIELDS; f++) {
+				out[f][j] = (struct lttb_point){ s.time_ms, v[f] };
+			}
+		}
+	} else if (lttb(range, count, points, fields, out)) {
+		goto exit_free;
+	}
+
+	if (buf_append(b, "{", 1)) {
+		goto exit_free;
+	}
+	for (f = 0; f < SAMPLE_FIELDS; f++) {
+		if (!(fields & (1u << f))) {
+			continue;
+		}
+		p = buf_reserve(b, 32);
+		if (p == NULL) {
+			goto exit_free;
+		}
+		b->len += sprintf(p, "%s\"%s\":[", b->len > 1 ? "," : "", sample_fields[f].name);
+		for (j = 0; j < n; j++) {
+			start = p = buf_reserve(b, 48);
+			if (p == NULL) {
+				goto exit_free;
+			}
+			p += sprintf(p, "%s[%" PRIu64 ",", j ? "," : "", out[f][j].t);
+			p = fixed_put(p, out[f][j].v, sample_fields[f].digits, 0);
+			*p++ = ']';
+			b->len += p - start;
+		}
+		if (buf_append(b, "]", 1)) {
+			goto exit_free;
+		}
+	}
+	ret = buf_append(b, "}", 1);
+
+exit_free:
+	for (f = 0; f < SAMPLE_FIELDS; f++) {
+		free(out[f]);
+	}
+	return ret;
+}
+
+/*
+ * field list, comma separated names
+ */
+static unsigned parse_fields(const char *p) {
+	unsigned fields = 0;
+	size_t len;
+	int f;
+
+	while (*p && *p != '&') {
+		len = strcspn(p, ",&");
+		for (f = 0; f < SAMPLE_FIELDS; f++) {
+			if (strlen(sample_fields[f].name) == len && strncmp(p, sample_fields[f].name, len) == 0) {
+				fields |= 1u << f;
+			}
+		}
+		p += len;
+		if (*p == ',') {
+			p++;
+		}
+	}
+	return fields;
+}
+
+/*
+ * /history?since=<unix msec>&until=<unix msec>&device=<id>
+ * Without points the samples are returned as they are, newer than since.
+ */
+static int build_history(struct http_server *srv, struct http_buf *b, const char *query) {
+	struct sample_iter it;
+	struct sensor_sample_t s;
+	uint64_t since = 0, until = UINT64_MAX;
+	unsigned fields = (1u << SAMPLE_FIELDS) - 1;
+	long device = -1;
+	long points = 0;
+	const char *p;
+	int first = 1;
+
+	for (p = query; p != NULL; p = strchr(p, '&')) {
+		if (*p == '&') {
+			p++;
+		}
+		if (strncmp(p, "since=", 6) == 0) {
+			since = strtoull(p + 6, NULL, 10);
+		} else if (strncmp(p, "until=", 6) == 0) {
+			until = strtoull(p + 6, NULL, 10);
+		} else if (strncmp(p, "device=", 7) == 0) {
+			device = strtol(p + 7, NULL, 10);
+		} else if (strncmp(p, "points=", 7) == 0) {
+			points = strtol(p + 7, NULL, 10);
+		} else if (strncmp(p, "fields=", 7) == 0) {
+			fields = parse_fields(p + 7);
+		}
+	}
+
+	if (query != NULL && strstr(query, "points=") != NULL) {
+		if (points < 3 || points > HTTP_MAX_POINTS || fields == 0) {
+			return 400;
+		}
+		// one series per field, so one device
+		sample_iter_start(&it, srv, device < 0 ? 0 : device, since, until);
+		return build_downsampled(b, &it, points, fields) ? 500 : 200;
+	}
+
+	sample_iter_start(&it, srv, device, since + 1, until);
+	buf_append(b, "[", 1);
+	while (sample_iter_next(&it, &s)) {
+		if (!first && buf_append(b, ",", 1)) {
+			return 500;
+		}
+		if (json_sample(b, srv, &s)) {
+			return 500;
+		}
+		first = 0;
+	}
+	return buf_append(b, "]", 1) ? 500 : 200;
+}
+
+/*
+ * rollup bucket to JSON object
+ */
+static int json_bucket(struct http_buf *b, struct http_server *srv, int device,
+		       const struct rollup_bucket *bucket) {
+	const struct rollup_field *f;
+	int64_t mean;
+	char *start, *p;
+	int i;
+
+	start = p = buf_reserve(b, HTTP_BUCKET_JSON_MAX);
+	if (p == NULL) {
+		return -1;
+	}
+
+	p += snprintf(p, 128, "{\"device\":\"%.*s\",\"id\":%d,\"start\":%" PRIu64 ",\"count\":%u",
+		      DEVICE_LABEL_LEN, srv->devs[device].label, device, bucket->start_ms, bucket->count);
+	for (i = 0; i < SAMPLE_FIELDS; i++) {
+		f = &bucket->f[i];
+		if (f->count == 0) {
+			p += sprintf(p, ",\"%s\":null", sample_fields[i].name);
+			continue;
+		}
+		// mean rounded half away from zero, in sensor units
+		mean = f->sum >= 0 ? (f->sum + f->count / 2) / f->count :
+			(f->sum - f->count / 2) / f->count;
+		p += sprintf(p, ",\"%s\":{\"min\":", sample_fields[i].name);
+		p = fixed_put(p, f->min, sample_fields[i].digits, 0);
+		p = stpcpy(p, ",\"max\":");
+		p = fixed_put(p, f->max, sample_fields[i].digits, 0);
+		p = stpcpy(p, ",\"mean\":");
+		p = fixed_put(p, (int32_t)mean, sample_fields[i].digits, 0);
+		p = stpcpy(p, ",\"last\":");
+		p = fixed_put(p, f->last, sample_fields[i].digits, 0);
+		*p++ = '}';
+	}
+	*p++ = '}';
+
+	b->len += p - start;
+	return 0;
+}
+
+/*
+ * /rollup?level=<minute|hour|day>&since=<unix msec>&until=<unix msec>&device=<id>
+ * Buckets whose start lies in [since, until], oldest first. until defaults
+ * to now, since to as far back as the level keeps.
+ */
+static int build_rollup(struct http_server *srv, struct http_buf *b, const char *query) {
+	const struct rollup_bucket *bucket;
+	struct timespec ts;
+	uint64_t since = 0, until, width, n, from, to;
+	uint32_t capacity;
+	long device = -1;
+	int level = ROLLUP_HOUR;
+	const char *p;
+	int first = 1;
+	int i, ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	until = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	for (p = query; p != NULL; p = strchr(p, '&')) {
+		if (*p == '&') {
+			p++;
+		}
+		if (strncmp(p, "level=", 6) == 0) {
+			level = rollup_level_parse(p + 6, strcspn(p + 6, "&"));
+			if (level < 0) {
+				return 400;
+			}
+		} else if (strncmp(p, "since=", 6) == 0) {
+			since = strtoull(p + 6, NULL, 10);
+		} else if (strncmp(p, "until=", 6) == 0) {
+			until = strtoull(p + 6, NULL, 10);
+		} else if (strncmp(p, "device=", 7) == 0) {
+			device = strtol(p + 7, NULL, 10);
+		}
+	}
+	if (srv->rollup == NULL) {
+		return 404;
+	}
+
+	width = rollup_width_ms(level);
+	capacity = srv->rollup->hdr->buckets[level];
+	to = until / width;
+	from = (since + width - 1) / width;
+	if (to + 1 > capacity && from < to + 1 - capacity) {
+		from = to + 1 - capacity;
+	}
+
+	buf_append(b, "[", 1);
+	rollup_lock(srv->rollup);
+	for (i = 0; i < srv->dev_count && ret == 0; i++) {
+		if (device >= 0 && i != device) {
+			continue;
+		}
+		for (n = from; n <= to; n++) {
+			bucket = rollup_bucket(srv->rollup, level, i, n);
+			if (bucket == NULL) {
+				continue;
+			}
+			if ((!first && buf_append(b, ",", 1)) || json_bucket(b, srv, i, bucket)) {
+				ret = 500;
+				break;
+			}
+			first = 0;
+		}
+	}
+	rollup_unlock(srv->rollup);
+	if (ret) {
+		return ret;
+	}
+	return buf_append(b, "]", 1) ? 500 : 200;
+}
+
+/*
+ * one block store record into the /range response
+ */
+struct range_ctx {
+	struct http_server *srv;
+	struct http_buf *b;
+	long limit;
+	int first;
+	int error;
+};
+
+static int range_visit(void *ctx, const struct sensor_sample_t *s) {
+	struct range_ctx *r = ctx;
+
+	if (r->limit-- <= 0) {
+		return 1;
+	}
+	if ((!r->first && buf_append(r->b, ",", 1)) || json_sample(r->b, r->srv, s)) {
+		r->error = 1;
+		return 1;
+	}
+	r->first = 0;
+	return 0;
+}
+
+/*
+ * /range?since=<unix msec>&until=<unix msec>&device=<id>&limit=<n>
+ * Samples with since <= time <= until out of the block store, oldest first
+ * per device. At most limit (default and cap HTTP_RANGE_MAX) are returned.
+ */
+static int build_range(struct http_server *srv, struct http_buf *b, const char *query) {
+	struct range_ctx r = { srv, b, HTTP_RANGE_MAX, 1, 0 };
+	uint64_t since = 0, until = UINT64_MAX;
+	long device = -1;
+	const char *p;
+	int i;
+
+	for (p = query; p != NULL; p = strchr(p, '&')) {
+		if (*p == '&') {
+			p++;
+		}
+		if (strncmp(p, "since=", 6) == 0) {
+			since = strtoull(p + 6, NULL, 10);
+		} else if (strncmp(p, "until=", 6) == 0) {
+			until = strtoull(p + 6, NULL, 10);
+		} else if (strncmp(p, "device=", 7) == 0) {
+			device = strtol(p + 7, NULL, 10);
+		} else if (strncmp(p, "limit=", 6) == 0) {
+			r.limit = strtol(p + 6, NULL, 10);
+		}
+	}
+	if (srv->stores == NULL) {
+		return 404;
+	}
+	if (r.limit <= 0 || r.limit > HTTP_RANGE_MAX || since > until) {
+		return 400;
+	}
+
+	buf_append(b, "[", 1);
+	for (i = 0; i < srv->dev_count && r.limit > 0; i++) {
+		if (device >= 0 && i != device) {
+			continue;
+		}
+		if (block_store_query(&srv->stores[i], since, until, range_visit, &r) < 0 || r.error) {
+			return 500;
+		}
+	}
+	return buf_append(b, "]", 1) ? 500 : 200;
+}
+
+/*
+ * /stats
+ */
+static int build_stats(struct http_server *srv, struct http_buf *b) {
+	char *text = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int ret;
+
+	fp = open_memstream(&text, &len);
+	if (fp == NULL) {
+		return 500;
+	}
+	stats_json(fp, srv->devs, srv->dev_count);
+	if (fclose(fp)) {
+		free(text);
+		return 500;
+	}
+	ret = buf_append(b, text, len);
+	free(text);
+	return ret ? 500 : 200;
+}
+
+/*
+ * /events
+ * Only the stream header is sent here, the connection then follows the
+ * shared event buffer.
+ */
+static void start_events(struct http_server *srv, struct http_conn *conn) {
+	static const char header[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"Connection: keep-alive\r\n\r\n"
+		"retry: 3000\n\n";
+
+	conn->out = malloc(sizeof(header) - 1);
+	if (conn->out == NULL) {
+		return;
+	}
+	memcpy(conn->out, header, sizeof(header) - 1);
+	conn->out_len = sizeof(header) - 1;
+	conn->out_pos = 0;
+	conn->stream = 1;
+	conn->event_pos = srv->event_head;
+}
+
+/*
+ * content type by extension
+ */
+static const char *content_type(const char *path) {
+	static const struct {
+		const char *ext;
+		const char *type;
+	} types[] = {
+		{ ".html",	"text/html; charset=utf-8" },
+		{ ".js",	"application/javascript" },
+		{ ".csv",	"text/csv" },
+		{ ".css",	"text/css" },
+		{ ".json",	"application/json" },
+	};
+	const char *ext = strrchr(path, '.');
+	unsigned int i;
+
+	for (i = 0; ext != NULL && i < sizeof(types) / sizeof(types[0]); i++) {
+		if (strcmp(ext, types[i].ext) == 0) {
+			return types[i].type;
+		}
+	}
+	return "application/octet-stream";
+}
+
+/*
+ * static file
+ * Returns 0, or the http status to answer with.
+ */
+static int build_file(struct http_server *srv, struct http_buf *b, const char *path) {
+	char file[PATH_MAX];
+	struct stat st;
+	ssize_t ret;
+	char *p;
+	int fd;
+
+	if (srv->www_root == NULL) {
+		return 404;
+	}
+	if (strcmp(path, "/") == 0) {
+		path = HTTP_INDEX;
+	}
+	if (strstr(path, "..") != NULL) {
+		return 403;
+	}
+	snprintf(file, sizeof(file), "%s%s", srv->www_root, path);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return 404;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return 404;
+	}
+	p = buf_reserve(b, st.st_size);
+	if (p == NULL) {
+		close(fd);
+		return 500;
+	}
+	while (b->len < (size_t)st.st_size) {
+		ret = read(fd, b->p + b->len, st.st_size - b->len);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		b->len += ret;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * status line text
+ */
+static const char *status_text(int status) {
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	default:  return "Internal Server Error";
+	}
+}
+
+/*
+ * request handling
+ * Builds the complete response of a received request into conn->out.
+ */
+static void handle_request(struct http_server *srv, struct http_conn *conn) {
+	struct http_buf body = { 0 };
+	const char *type = "application/json";
+	char header[256];
+	char *path, *query, *end;
+	int status = 200;
+	int head = 0;
+	int len;
+
+	conn->req[conn->req_len] = 0;
+	path = strchr(conn->req, ' ');
+	end = path ? strchr(path + 1, ' ') : NULL;
+	if (path == NULL || end == NULL) {
+		status = 400;
+	} else if (strncmp(conn->req, "GET ", 4) != 0 && strncmp(conn->req, "HEAD ", 5) != 0) {
+		status = 405;
+	} else {
+		head = (conn->req[0] == 'H');
+		path++;
+		*end = 0;
+		query = strchr(path, '?');
+		if (query != NULL) {
+			*query++ = 0;
+		}
+
+		if (strcmp(path, "/events") == 0 && !head) {
+			start_events(srv, conn);
+			return;
+		} else if (strcmp(path, "/latest") == 0) {
+			status = build_latest(srv, &body) ? 500 : 200;
+		} else if (strcmp(path, "/history") == 0) {
+			status = build_history(srv, &body, query);
+		} else if (strcmp(path, "/rollup") == 0) {
+			status = build_rollup(srv, &body, query);
+		} else if (strcmp(path, "/stats") == 0) {
+			status = build_stats(srv, &body);
+		} else if (strcmp(path, "/range") == 0) {
+			status = build_range(srv, &body, query);
+		} else {
+			status = build_file(srv, &body, path);
+			if (status == 0) {
+				status = 200;
+				type = content_type(path[1] ? path : HTTP_INDEX);
+			}
+		}
+	}
+
+	if (status != 200) {
+		body.len = 0;
+		type = "text/plain";
+		len = snprintf(header, sizeof(header), "%d %s\n", status, status_text(status));
+		buf_append(&body, header, len);
+	}
+
+	len = snprintf(header, sizeof(header),
+		       "HTTP/1.1 %d %s\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Access-Control-Allow-Origin: *\r\n"
+		       "Cache-Control: no-cache\r\n"
+		       "Connection: close\r\n\r\n",
+		       status, status_text(status), type, body.len);
+
+	if (head) {
+		body.len = 0;
+	}
+	conn->out = malloc(len + body.len);
+	if (conn->out == NULL) {
+		free(body.p);
+		conn->out_len = 0;
+		return;
+	}
+	memcpy(conn->out, header, len);
+	if (body.len) {
+		memcpy(conn->out + len, body.p, body.len);
+	}
+	conn->out_len = len + body.len;
+	conn->out_pos = 0;
+	free(body.p);
+}
+
+/*
+ * connection close
+ */
+static void conn_close(struct http_conn *conn) {
+	close(conn->fd);
+	free(conn->out);
+	memset(conn, 0, sizeof(*conn));
+	conn->fd = -1;
+}
+
+/*
+ * new clients
+ */
+static void accept_clients(struct http_server *srv) {
+	struct http_conn *conn;
+	int fd, i;
+
+	for (;;) {
+		fd = accept(srv->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			return;
+		}
+		for (i = 0; i < HTTP_MAX_CONN && srv->conns[i].fd >= 0; i++)
+			;
+		if (i == HTTP_MAX_CONN) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		conn = &srv->conns[i];
+		conn->fd = fd;
+		conn->req_len = 0;
+		conn->out = NULL;
+	}
+}
+
+/*
+ * client readable
+ */
+static void conn_read(struct http_server *srv, struct http_conn *conn) {
+	char discard[256];
+	ssize_t ret;
+
+	// an event stream only reads to notice the client going away
+	if (conn->stream) {
+		ret = read(conn->fd, discard, sizeof(discard));
+		if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+			conn_close(conn);
+		}
+		return;
+	}
+
+	ret = read(conn->fd, conn->req + conn->req_len, HTTP_REQ_LEN - 1 - conn->req_len);
+	if (ret <= 0) {
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		conn_close(conn);
+		return;
+	}
+	conn->req_len += ret;
+	conn->req[conn->req_len] = 0;
+
+	// the request line is all that is needed, headers are skipped
+	if (strstr(conn->req, "\r\n\r\n") || strstr(conn->req, "\n\n") ||
+	    conn->req_len == HTTP_REQ_LEN - 1) {
+		handle_request(srv, conn);
+		if (conn->out == NULL) {
+			conn_close(conn);
+		}
+	}
+}
+
+/*
+ * event stream writable
+ * Sends straight out of the shared buffer. A client that fell a whole
+ * buffer behind is dropped, EventSource reconnects by itself.
+ */
+static void stream_write(struct http_server *srv, struct http_conn *conn) {
+	size_t off, len;
+	ssize_t ret;
+
+	if (srv->event_head - conn->event_pos > HTTP_EVENT_BUF_LEN) {
+		conn_close(conn);
+		return;
+	}
+	off = conn->event_pos % HTTP_EVENT_BUF_LEN;
+	len = srv->event_head - conn->event_pos;
+	if (len > HTTP_EVENT_BUF_LEN - off) {
+		len = HTTP_EVENT_BUF_LEN - off;
+	}
+
+	ret = send(conn->fd, srv->events + off, len, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			conn_close(conn);
+		}
+		return;
+	}
+	conn->event_pos += ret;
+}
+
+/*
+ * client writable
+ */
+static void conn_write(struct http_server *srv, struct http_conn *conn) {
+	ssize_t ret;
+
+	if (conn->out == NULL) {
+		stream_write(srv, conn);
+		return;
+	}
+
+	ret = send(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return;
+		}
+		conn_close(conn);
+		return;
+	}
+	conn->out_pos += ret;
+	if (conn->out_pos < conn->out_len) {
+		return;
+	}
+	if (conn->stream) {
+		free(conn->out);
+		conn->out = NULL;
+		return;
+	}
+	conn_close(conn);
+}
+
+/*
+ * poll hook: descriptors to watch
+ */
+static int http_prepare(void *ctx, struct pollfd *pfds, int max) {
+	struct http_server *srv = ctx;
+	int i, n = 0;
+
+	if (n < max) {
+		pfds[n].fd = srv->listen_fd;
+		pfds[n].events = POLLIN;
+		pfds[n].revents = 0;
+		n++;
+	}
+	for (i = 0; i < HTTP_MAX_CONN && n < max; i++) {
+		if (srv->conns[i].fd < 0) {
+			continue;
+		}
+		pfds[n].fd = srv->conns[i].fd;
+		pfds[n].events = srv->conns[i].out ? POLLOUT : POLLIN;
+		if (srv->conns[i].stream && srv->conns[i].event_pos < srv->event_head) {
+			pfds[n].events |= POLLOUT;
+		}
+		pfds[n].revents = 0;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * poll hook: events
+ */
+static void http_dispatch(void *ctx, struct pollfd *pfds, int count) {
+	struct http_server *srv = ctx;
+	struct http_conn *conn;
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		if (pfds[i].revents == 0) {
+			continue;
+		}
+		if (pfds[i].fd == srv->listen_fd) {
+			accept_clients(srv);
+			continue;
+		}
+		for (j = 0; j < HTTP_MAX_CONN; j++) {
+			conn = &srv->conns[j];
+			if (conn->fd != pfds[i].fd) {
+				continue;
+			}
+			if (pfds[i].revents & (POLLERR | POLLNVAL)) {
+				conn_close(conn);
+			} else if (pfds[i].revents & POLLOUT) {
+				conn_write(srv, conn);
+			} else {
+				conn_read(srv, conn);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * http server open
+ */
+int http_server_open(struct http_server *srv, int port, const char *www_root,
+		     struct sensor_device *devs, int dev_count) {
+	struct sockaddr_in addr;
+	int on = 1;
+	int i;
+
+	memset(srv, 0, sizeof(*srv));
+	for (i = 0; i < HTTP_MAX_CONN; i++) {
+		srv->conns[i].fd = -1;
+	}
+	srv->www_root = www_root;
+	srv->devs = devs;
+	srv->dev_count = dev_count;
+
+	srv->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (srv->listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		goto exit_close;
+	}
+	if (listen(srv->listen_fd, HTTP_BACKLOG) < 0) {
+		perror("listen");
+		goto exit_close;
+	}
+
+	srv->hook.prepare = http_prepare;
+	srv->hook.dispatch = http_dispatch;
+	srv->hook.ctx = srv;
+	if (frame_reader_add_hook(&srv->hook)) {
+		goto exit_close;
+	}
+	return 0;
+
+exit_close:
+	close(srv->listen_fd);
+	srv->listen_fd = -1;
+	return -1;
+}
+
+/*
+ * event publish
+ * The sample is formatted once into the shared buffer, every stream
+ * picks it up from there when its socket is writable.
+ */
+static void publish_event(struct http_server *srv, const struct sensor_sample_t *sample) {
+	struct http_buf b = { 0 };
+	size_t off, first;
+
+	if (buf_append(&b, "data: ", 6) || json_sample(&b, srv, sample) || buf_append(&b, "\n\n", 2)) {
+		free(b.p);
+		return;
+	}
+
+	off = srv->event_head % HTTP_EVENT_BUF_LEN;
+	first = HTTP_EVENT_BUF_LEN - off;
+	if (first > b.len) {
+		first = b.len;
+	}
+	memcpy(srv->events + off, b.p, first);
+	memcpy(srv->events, b.p + first, b.len - first);
+	srv->event_head += b.len;
+	free(b.p);
+}
+
+/*
+ * output sink entry
+ */
+void http_server_sink(void *ctx, const struct sensor_sample_t *sample) {
+	struct http_server *srv = ctx;
+
+	if (sample->device_id < srv->dev_count) {
+		srv->latest[sample->device_id] = *sample;
+		srv->has_latest[sample->device_id] = 1;
+	}
+	srv->history[srv->history_count % HTTP_HISTORY_LEN] = *sample;
+	srv->history_count++;
+
+	publish_event(srv, sample);
+}
+
+/*
+ * http server close
+ */
+void http_server_close(struct http_server *srv) {
+	int i;
+
+	// never opened, the connection slots are not set up
+	if (srv->listen_fd < 0) {
+		return;
+	}
+	for (i = 0; i < HTTP_MAX_CONN; i++) {
+		if (srv->conns[i].fd >= 0) {
+			conn_close(&srv->conns[i]);
+		}
+	}
+	close(srv->listen_fd);
+	srv->listen_fd = -1;
+}
@@ -0,0 +1,95 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __HTTP_SERVER__
+#define __HTTP_SERVER__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+#include "device.h"
+#include "frame_reader.h"
+#include "ring_file.h"
+#include "block_store.h"
+#include "rollup.h"
+
+#define HTTP_MAX_CONN		(16)
+#define HTTP_REQ_LEN		(2048)
+#define HTTP_HISTORY_LEN	(3600)	// samples kept in memory for /history
+#define HTTP_EVENT_BUF_LEN	(64 * 1024)	// shared /events fan-out buffer
+#define HTTP_RANGE_MAX		(86400)	// samples per /range response
+
+/*
+ * one client connection
+ * The request is collected in req, the whole response is built in out
+ * and written as the socket accepts it. Connections close after one
+ * response, except /events streams which then follow the event buffer
+ * from event_pos on.
+ */
+struct http_conn {
+	int fd;
+	size_t req_len;
+	char req[HTTP_REQ_LEN];
+	char *out;
+	size_t out_len;
+	size_t out_pos;
+	int stream;
+	uint64_t event_pos;
+};
+
+/*
+ * embedded http server
+ * Runs inside the collector thread through a poll hook. Endpoints:
+ *   /latest            : newest sample of every device, JSON
+ *   /history?since=ms  : samples newer than since (unix msec), JSON
+ *   /history?points=n  : at most n points per field (LTTB), from the ring
+ *                        file when ring is set
+ *   /events            : Server-Sent Events, one "data:" JSON per sample
+ *   /rollup?level=hour : min/max/mean/last buckets, when rollup is set
+ *   /range?since=&until= : samples of a time range from the block store,
+ *                        when stores is set
+ *   /stats             : link counters and latency histograms, JSON
+ *   anything else      : static files under the document root, if given
+ */
+struct http_server {
+	int listen_fd;
+	const char *www_root;
+	struct sensor_device *devs;
+	int dev_count;
+	struct sensor_sample_t latest[MAX_DEVICES];
+	int has_latest[MAX_DEVICES];
+	struct sensor_sample_t history[HTTP_HISTORY_LEN];
+	uint64_t history_count;		// samples ever stored
+	char events[HTTP_EVENT_BUF_LEN];	// each sample formatted once for all streams
+	uint64_t event_head;		// bytes ever appended to events
+	struct rollup *rollup;		// set after http_server_open(), may be NULL
+	struct ring_file *ring;		// likewise
+	struct block_store *stores;	// likewise, MAX_DEVICES of them
+	struct http_conn conns[HTTP_MAX_CONN];
+	struct poll_hook hook;
+};
+
+int http_server_open(struct http_server *srv, int port, const char *www_root,
+		     struct sensor_device *devs, int dev_count);
+
+void http_server_sink(void *ctx, const struct sensor_sample_t *sample);
+
+void http_server_close(struct http_server *srv);
+
+#endif /* __HTTP_SERVER__ */
@@ -0,0 +1,137 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "link_retry.h"
+
+void link_retry_init(struct link_retry *lr, unsigned int seed) {
+	memset(lr, 0, sizeof(*lr));
+	lr->timeout_ms = RETRY_MAX_TIMEOUT_MS;
+	lr->seed = seed;
+}
+
+static int rtt_compare(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * a measured round trip, the timeout follows
+ */
+void link_retry_rtt(struct link_retry *lr, uint64_t rtt_us) {
+	uint32_t sorted[RETRY_RTT_SAMPLES];
+	long timeout;
+
+	lr->rtt_us[lr->rtt_pos] = rtt_us > UINT32_MAX ? UINT32_MAX : rtt_us;
+	lr->rtt_pos = (lr->rtt_pos + 1) % RETRY_RTT_SAMPLES;
+	if (lr->rtt_count < RETRY_RTT_SAMPLES) {
+		lr->rtt_count++;
+	}
+
+	memcpy(sorted, lr->rtt_us, lr->rtt_count * sizeof(sorted[0]));
+	qsort(sorted, lr->rtt_count, sizeof(sorted[0]), rtt_compare);
+	timeout = sorted[(lr->rtt_count * RETRY_PERCENTILE + 99) / 100 - 1] * 3 / 1000 + RETRY_MARGIN_MS;
+	if (timeout < RETRY_MIN_TIMEOUT_MS) {
+		timeout = RETRY_MIN_TIMEOUT_MS;
+	}
+	if (timeout > RETRY_MAX_TIMEOUT_MS) {
+		timeout = RETRY_MAX_TIMEOUT_MS;
+	}
+	lr->timeout_ms = timeout;
+}
+
+/*
+ * response timeout of attempt n (0 for the first send)
+ */
+long link_retry_timeout_ms(struct link_retry *lr, int attempt) {
+	long timeout = lr->timeout_ms;
+
+	while (attempt-- > 0 && timeout < RETRY_MAX_TIMEOUT_MS) {
+		timeout *= 2;
+	}
+	return timeout < RETRY_MAX_TIMEOUT_MS ? timeout : RETRY_MAX_TIMEOUT_MS;
+}
+
+/*
+ * wait before attempt n, full jitter below an exponential cap
+ */
+long link_retry_backoff_ms(struct link_retry *lr, int attempt) {
+	long cap = RETRY_BACKOFF_MS;
+
+	while (--attempt > 0 && cap < RETRY_BACKOFF_MAX_MS) {
+		cap *= 2;
+	}
+	if (cap > RETRY_BACKOFF_MAX_MS) {
+		cap = RETRY_BACKOFF_MAX_MS;
+	}
+	return rand_r(&lr->seed) % (cap + 1);
+}
+
+/*
+ * may a command sent attempts times, elapsed_ms ago, be sent once more
+ */
+int link_retry_again(struct link_retry *lr, int attempts, long elapsed_ms) {
+	if (lr->degraded || attempts >= RETRY_MAX_ATTEMPTS) {
+		return 0;
+	}
+	return elapsed_ms + RETRY_BACKOFF_MAX_MS + link_retry_timeout_ms(lr, attempts) <= RETRY_BUDGET_MS;
+}
+
+/*
+ * should a poll talk to the link now
+ */
+int link_retry_due(struct link_retry *lr) {
+	struct timespec now;
+
+	if (!lr->degraded) {
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > lr->probe_at.tv_sec ||
+		(now.tv_sec == lr->probe_at.tv_sec && now.tv_nsec >= lr->probe_at.tv_nsec);
+}
+
+/*
+ * outcome of a command
+ */
+void link_retry_result(struct link_retry *lr, int ok, const char *name) {
+	if (ok) {
+		if (lr->degraded) {
+			fprintf(stderr, "%s: link recovered.\n", name);
+		}
+		lr->failures = 0;
+		lr->degraded = 0;
+		return;
+	}
+
+	if (++lr->failures >= RETRY_DEGRADED_FAILURES && !lr->degraded) {
+		fprintf(stderr, "%s: link degraded after %d failed commands.\n", name, lr->failures);
+		lr->degraded = 1;
+	}
+	if (lr->degraded) {
+		clock_gettime(CLOCK_MONOTONIC, &lr->probe_at);
+		lr->probe_at.tv_sec += RETRY_PROBE_MS / 1000;
+	}
+}
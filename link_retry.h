@@ -0,0 +1,74 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __LINK_RETRY__
+#define __LINK_RETRY__
+
+#include <stdint.h>
+#include <time.h>
+
+#define RETRY_MAX_ATTEMPTS	(10)	// sends per command
+#define RETRY_RTT_SAMPLES	(32)	// round trips the timeout is taken from
+#define RETRY_PERCENTILE	(95)
+#define RETRY_MIN_TIMEOUT_MS	(100)
+#define RETRY_MAX_TIMEOUT_MS	(1000)
+#define RETRY_MARGIN_MS		(50)
+#define RETRY_BACKOFF_MS	(20)	// backoff cap of the first re-send, doubled per attempt
+#define RETRY_BACKOFF_MAX_MS	(500)
+#define RETRY_BUDGET_MS		(3000)	// all attempts of one command
+#define RETRY_DEGRADED_FAILURES	(3)	// failed commands in a row
+#define RETRY_PROBE_MS		(30 * 1000)	// a degraded link is tried this often
+
+/*
+ * retry policy of one serial link
+ * The response timeout follows the link: RETRY_PERCENTILE of the last
+ * RETRY_RTT_SAMPLES round trips, times three plus RETRY_MARGIN_MS, kept
+ * within RETRY_MIN_TIMEOUT_MS and RETRY_MAX_TIMEOUT_MS. Every re-send
+ * doubles it (up to the maximum) and waits a jittered, exponentially
+ * growing backoff first. A command gives up after RETRY_MAX_ATTEMPTS
+ * sends or RETRY_BUDGET_MS, whichever comes first.
+ * After RETRY_DEGRADED_FAILURES failed commands in a row the link is
+ * degraded: commands get a single attempt, and polling only probes it
+ * every RETRY_PROBE_MS, until a command succeeds again.
+ */
+struct link_retry {
+	uint32_t rtt_us[RETRY_RTT_SAMPLES];
+	int rtt_count;
+	int rtt_pos;
+	long timeout_ms;		// first attempt timeout
+	int failures;			// failed commands in a row
+	int degraded;
+	struct timespec probe_at;	// next probe of a degraded link
+	unsigned int seed;
+};
+
+void link_retry_init(struct link_retry *lr, unsigned int seed);
+
+void link_retry_rtt(struct link_retry *lr, uint64_t rtt_us);
+
+long link_retry_timeout_ms(struct link_retry *lr, int attempt);
+
+long link_retry_backoff_ms(struct link_retry *lr, int attempt);
+
+int link_retry_again(struct link_retry *lr, int attempts, long elapsed_ms);
+
+int link_retry_due(struct link_retry *lr);
+
+void link_retry_result(struct link_retry *lr, int ok, const char *name);
+
+#endif /* __LINK_RETRY__ */
@@ -23,125 +23,317 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <termios.h>
+#include <getopt.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
+#include "block_store.h"
+#include "cmd_queue.h"
 #include "common.h"
+#include "data_output.h"
+#include "device.h"
+#include "frame_reader.h"
+#include "http_server.h"
+#include "register_map.h"
+#include "ring_file.h"
+#include "rollup.h"
 #include "sensor_data.h"
+#include "stats.h"
 
 static void usage(char *basename) {
-	printf("usage: %s <device> <mode> <csv path>\n\n", basename);
+	printf("usage: %s [options] <device> <mode> <csv path>\n\n", basename);
 	printf(
 		"A program that acquires data from [omron 2JCIE - BU 01] by USB communication.\n"
-		"  device   : Omron USB Device Path.\n"
-		"  mode     : Amount of data to read. Laster data = 0 , Memory all data = 1\n"
-		"  csv path : Create csv file full path. If not specified, it is displayed on standard output.\n");
+		"  device   : Omron USB Device Path. Several devices are given as a comma separated\n"
+		"             list or a quoted glob (\"/dev/ttyUSB*\"), their samples are tagged\n"
+		"             with the device name.\n"
+		"  mode     : Amount of data to read. Laster data = 0 , Memory all data = 1 , Daemon = 2\n"
+		"  csv path : Create csv file full path. If not specified, it is displayed on standard output.\n"
+		"\n"
+		"options:\n"
+		"  -i, --interval <msec> : Polling interval in daemon mode. (default %d, min %d)\n"
+		"  -s, --state <path>    : Memory data mode only fetches records newer than the\n"
+		"                          index saved in this file, and appends to csv path.\n"
+		"  -f, --format <fmt>    : Output format, csv (default) or bin. bin writes fixed\n"
+		"                          32 byte little-endian records after a 16 byte header.\n"
+		"  -r, --ring <path>     : Also append every latest sample to this mmap ring file.\n"
+		"  -R, --ring-size <n>   : Records held by the ring file. (default %d)\n"
+		"  -p, --port <port>     : Daemon mode serves /latest and /history?since=<msec>\n"
+		"                          as JSON over HTTP on this port.\n"
+		"  -w, --www <dir>       : The HTTP server also serves the chart pages from dir.\n"
+		"  -u, --rollup <path>   : Keep min/max/mean/last of every field per minute, hour\n"
+		"                          and day in this file, served at /rollup?level=hour.\n"
+		"  -b, --store <path>    : Append every sample to a time indexed block store at\n"
+		"                          path (index in path.idx), served at /range.\n"
+		"  -S, --stats <sec>     : Print link counters and latency histograms as a JSON\n"
+		"                          line to stderr every sec seconds in daemon mode and\n"
+		"                          once at exit. They are also served at /stats.\n"
+		"  -e, --status          : Read the error status register along with the latest\n"
+		"                          data, samples of a faulty sensor are flagged.\n"
+		"  -t, --table <name>    : Latest data register to read, given per device as a comma\n"
+		"                          separated list whose last entry also applies to the rest.\n"
+		"                          short (0x5022, every field, default), sensing (0x5012,\n"
+		"                          without discomfort index and heat stroke) or calc\n"
+		"                          (0x5013, only those two). Fields not read are empty.\n"
+		"  -F, --fields <list>   : Only decode and write these fields, comma separated from\n"
+		"                          temp, humid, light, press, noise, tvoc, co2, discom, heat.\n"
+		"                          Without -t the shortest register holding them is read,\n"
+		"                          with -t every given register has to hold them.\n"
+		"  -P, --pipeline        : Send the next request while the sensor still answers the\n"
+		"                          one before (memory data windows, the -e status read).\n"
+		"                          Only tried against the emulator, off by default.\n",
+		DEFAULT_INTERVAL_MS, MIN_INTERVAL_MS, RING_DEFAULT_RECORDS);
 }
 
+static const struct option long_options[] = {
+	{ "interval",	required_argument,	NULL,	'i' },
+	{ "state",	required_argument,	NULL,	's' },
+	{ "format",	required_argument,	NULL,	'f' },
+	{ "ring",	required_argument,	NULL,	'r' },
+	{ "ring-size",	required_argument,	NULL,	'R' },
+	{ "port",	required_argument,	NULL,	'p' },
+	{ "www",	required_argument,	NULL,	'w' },
+	{ "rollup",	required_argument,	NULL,	'u' },
+	{ "store",	required_argument,	NULL,	'b' },
+	{ "stats",	required_argument,	NULL,	'S' },
+	{ "status",	no_argument,		NULL,	'e' },
+	{ "table",	required_argument,	NULL,	't' },
+	{ "fields",	required_argument,	NULL,	'F' },
+	{ "pipeline",	no_argument,		NULL,	'P' },
+	{ "help",	no_argument,		NULL,	'h' },
+	{ NULL,		0,			NULL,	0 },
+};
+
 /*
- * init usb serial
+ * register table list, one per device
  */
-static int init_serial(int fd, struct termios *old_tio) {
-	int ret;
-	struct termios tio;
-
-	ret = tcgetattr(fd, old_tio);
-	if (ret) {
-		perror("tcgetattr");
-		return -1;
-	}
-
-	// new serial conf
-	memset(&tio, 0, sizeof(tio));
+static int parse_tables(char *arg, const struct register_table **tables, int max) {
+	char *entry, *save;
+	int count = 0;
 
-	tio.c_iflag = IGNBRK | IGNPAR;
-	tio.c_cflag = CS8 | CLOCAL | CREAD;
-	ret = cfsetspeed(&tio, SERIAL_BAUDRATE);
-	if (ret < 0) {
-		perror("cfsetspeed");
-		return -1;
+	for (entry = strtok_r(arg, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+		if (count >= max) {
+			break;
+		}
+		tables[count] = register_table_find(entry);
+		if (tables[count] == NULL) {
+			fprintf(stderr, "unknown register table %s.\n", entry);
+			return -1;
+		}
+		count++;
 	}
+	return count;
+}
 
-	ret = tcflush(fd, TCIFLUSH);
-	if (ret < 0) {
-		perror("tcflush");
-		return -1;
+/*
+ * add msec to timespec
+ */
+static void timespec_add_ms(struct timespec *ts, long msec) {
+	ts->tv_sec += msec / 1000;
+	ts->tv_nsec += (msec % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
 	}
+}
 
-	// new serial conf set
-	ret = tcsetattr(fd, TCSANOW, &tio);
-	if (ret < 0) {
-		perror("tcsetattr");
-		return -1;
+/*
+ * timespec compare
+ */
+static int timespec_before(struct timespec *a, struct timespec *b) {
+	if (a->tv_sec != b->tv_sec) {
+		return a->tv_sec < b->tv_sec;
 	}
+	return a->tv_nsec < b->tv_nsec;
+}
 
-	return 0;
+/*
+ * stats line to stderr
+ */
+static void stats_dump(struct sensor_device *devs, int count) {
+	stats_json(stderr, devs, count);
+	fputc('\n', stderr);
+	fflush(stderr);
 }
 
 /*
- * restore serial
+ * daemon mode
+ * The serial port stays open and the latest data is read on every tick of a
+ * CLOCK_MONOTONIC schedule, so wall clock adjustments do not disturb the period.
+ * Between ticks the process idles in poll(), serving registered poll hooks.
  */
-static void restore_serial(int fd, struct termios *old_tio) {
+static int run_daemon(struct sensor_device *devs, int count, char *csv_path, long interval_ms,
+		      long stats_sec) {
+	struct timespec next, now, stats_next;
+	long msec;
 	int ret;
 
-	ret = tcsetattr(fd, TCSANOW, old_tio);
-	if (ret < 0) {
-		perror("tcsetattr");
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	stats_next = next;
+	stats_next.tv_sec += stats_sec;
+
+	while (!is_terminated()) {
+		ret = get_latest_data(devs, count, csv_path);
+		if (ret && !is_terminated()) {
+			fprintf(stderr, "get latest data error.\n");
+		}
+		if (csv_path == NULL) {
+			fflush(stdout);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (stats_sec > 0 && !timespec_before(&now, &stats_next)) {
+			stats_dump(devs, count);
+			stats_next.tv_sec += stats_sec;
+		}
+
+		// next tick. Ticks already missed are skipped instead of bursting.
+		timespec_add_ms(&next, interval_ms);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (timespec_before(&next, &now)) {
+			timespec_add_ms(&next, interval_ms);
+		}
+
+		// interrupted by signal handler on termination
+		while (timespec_before(&now, &next) && !is_terminated()) {
+			msec = (next.tv_sec - now.tv_sec) * 1000 +
+				(next.tv_nsec - now.tv_nsec + 999999) / 1000000;
+			ret = frame_reader_poll(NULL, 0, msec);
+			if (ret < 0 && !is_terminated()) {
+				return -1;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		}
 	}
+
+	return 0;
 }
 
 /*
- * Find out name to use for lockfile when locking tty.
+ * per device path
+ * With several devices each one gets its own file, "<path>.<label>".
  */
-static char *dev_lockname(char *dev_name, char *res, int res_len) {
-	char *temp;
-
-	if (strncmp(dev_name, "/dev/", 5) == 0) {
-		// In dev
-		strncpy(res, dev_name + 5, res_len - 1);
-		res[res_len - 1] = 0;
-		for (temp = res; *temp; temp++) {
-			if (*temp == '/') {
-				*temp = '_';
-			}
-		}
-	} else {
-		// Outside of dev
-		if ((temp = strrchr(dev_name, '/')) == NULL ) {
-			temp = dev_name;
-		} else {
-			temp++;
-		}
-		strncpy(res, dev_name, res_len - 1);
-		res[res_len - 1] = 0;
+static char *device_path(char *buf, size_t len, char *path, struct sensor_device *dev) {
+	if (path == NULL || dev->tag == NULL) {
+		return path;
 	}
-	return res;
+	snprintf(buf, len, "%s.%s", path, dev->label);
+	return buf;
 }
 
 int main(int argc, char *argv[]) {
-	static int fd, mode;
-	static int lock_fd;
-	static int old_mask;
-	static int lock_check;
-	static char *dev_name;
+	static int mode;
+	static int dev_count, open_count;
+	static char *dev_names[MAX_DEVICES];
+	static struct sensor_device devs[MAX_DEVICES];
 	static char *csv_path;
-	static char lockfile[128];
-	static char lockbuf[127];
-	static struct termios tio;
+	static char *state_path;
+	static char dev_csv_path[PATH_MAX];
+	static char dev_state_path[PATH_MAX];
+	static char *ring_path;
+	static long ring_records = RING_DEFAULT_RECORDS;
+	static struct ring_file ring = { .fd = -1 };
+	static int http_port;
+	static char *www_root;
+	static struct http_server http = { .listen_fd = -1 };
+	static char *rollup_path;
+	static struct rollup rollup = { .fd = -1 };
+	static char *store_path;
+	static char dev_store_path[PATH_MAX];
+	static struct block_store stores[MAX_DEVICES];
+	static long interval_ms = DEFAULT_INTERVAL_MS;
+	static long stats_sec;
+	static const struct register_table *tables[MAX_DEVICES];
+	static int table_count;
+	static unsigned fields = FIELDS_ALL;
+	static int fields_given;
 
 	int ret = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt_long(argc, argv, "i:s:f:r:R:p:w:u:b:S:et:F:Ph", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			interval_ms = atol(optarg);
+			break;
+		case 's':
+			state_path = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "csv") == 0) {
+				output_format_set(OUTPUT_CSV);
+			} else if (strcmp(optarg, "bin") == 0) {
+				output_format_set(OUTPUT_BIN);
+			} else {
+				usage(basename(argv[0]));
+				return -1;
+			}
+			break;
+		case 'r':
+			ring_path = optarg;
+			break;
+		case 'R':
+			ring_records = atol(optarg);
+			break;
+		case 'p':
+			http_port = atoi(optarg);
+			break;
+		case 'w':
+			www_root = optarg;
+			break;
+		case 'u':
+			rollup_path = optarg;
+			break;
+		case 'b':
+			store_path = optarg;
+			break;
+		case 'S':
+			stats_sec = atol(optarg);
+			if (stats_sec <= 0) {
+				usage(basename(argv[0]));
+				return -1;
+			}
+			break;
+		case 'e':
+			latest_status_set(1);
+			break;
+		case 't':
+			table_count = parse_tables(optarg, tables, MAX_DEVICES);
+			if (table_count <= 0) {
+				usage(basename(argv[0]));
+				return -1;
+			}
+			break;
+		case 'F':
+			if (register_fields_parse(optarg, &fields)) {
+				usage(basename(argv[0]));
+				return -1;
+			}
+			output_fields_set(fields);
+			fields_given = 1;
+			break;
+		case 'P':
+			cmd_queue_overlap_set(1);
+			break;
+		default:
+			usage(basename(argv[0]));
+			return -1;
+		}
+	}
 
-	if (argc < 3) {
+	if (argc - optind < 2) {
 		usage(basename(argv[0]));
 		return -1;
 	}
 
-	dev_name = argv[1];
-	mode = atoi(argv[2]);
-	csv_path = argv[3];
+	mode = atoi(argv[optind + 1]);
+	csv_path = argv[optind + 2];
 
 	// mode num check
 	if (mode > MAX_MODE_NUM || mode < 0) {
@@ -149,92 +341,188 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
-	// USB port open
-	fd = open(dev_name, O_RDWR);
-	if (fd < 0) {
-		perror("port open");
+	// interval check
+	if (interval_ms < MIN_INTERVAL_MS) {
+		usage(basename(argv[0]));
 		return -1;
 	}
 
-	// serial port conf
-	ret = init_serial(fd,&tio);
-	if (ret) {
-		perror("serial");
-		//goto exit_close;
-		close(fd);
-		exit(-1);
+	// port check, the server only runs in daemon mode
+	if (http_port < 0 || http_port > 65535) {
+		usage(basename(argv[0]));
+		return -1;
+	}
+	if ((http_port > 0 || www_root != NULL) && mode != MODE_DAEMON) {
+		fprintf(stderr, "-p and -w are only for daemon mode.\n");
+		usage(basename(argv[0]));
+		return -1;
+	}
+
+	// an explicit table has to carry the selected fields
+	for (i = 0; fields_given && i < table_count; i++) {
+		if ((tables[i]->fields & fields) != fields) {
+			fprintf(stderr, "register table %s lacks selected fields.\n", tables[i]->name);
+			usage(basename(argv[0]));
+			return -1;
+		}
+	}
+
+	// ring size check
+	if (ring_records <= 0 || ring_records > UINT32_MAX / BIN_RECORD_LEN) {
+		usage(basename(argv[0]));
+		return -1;
+	}
+
+	dev_count = device_expand(argv[optind], dev_names, MAX_DEVICES);
+	if (dev_count <= 0) {
+		fprintf(stderr, "no device.\n");
+		return -1;
+	}
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		stores[i].fd = -1;
 	}
 
 	// handler
 	ret = install_sig_handler();
 	if (ret) {
 		perror("handler");
-		//goto exit_restore;
-		restore_serial(fd, &tio);
-		exit(-1);
-	}
-
-	// port lock
-	snprintf(lockfile, sizeof(lockfile), "/var/lock/LCK..%s", dev_lockname(dev_name, lockbuf, sizeof(lockbuf)));
-	if ((lock_fd = open(lockfile, O_RDONLY)) >= 0) {
-		lock_check = read(lock_fd, lockbuf, sizeof(lockbuf));
-		close(lock_fd);
-		if (lock_check > 0) {
-			// Lockfile is stale
-			unlink(lockfile);
-		} else if (lock_check == 0) {
-			// Device is locked
-			printf("Device %s is locked.\n",dev_name);
-			ret = -1;
-			//return exit_restore;
-			restore_serial(fd, &tio);
-			exit(-1);
-		}
-	}
-
-	old_mask = umask(022);
-	lock_fd = open(lockfile, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	umask(old_mask);
-	if (lock_fd < 0) {
-		perror("lockfile");
+		return -1;
+	}
+
+	// continuous log
+	if (ring_path != NULL) {
+		ret = ring_file_open(&ring, ring_path, ring_records);
+		if (ret) {
+			return -1;
+		}
+		output_sink_add(ring_file_sink, &ring);
+	}
+
+	// USB port open. A device that cannot be opened is left out.
+	for (i = 0; i < dev_count; i++) {
+		ret = device_open(&devs[open_count], dev_names[i], open_count);
+		if (ret) {
+			fprintf(stderr, "Device %s skipped.\n", dev_names[i]);
+			continue;
+		}
+		if (table_count > 0) {
+			devs[open_count].table = tables[i < table_count ? i : table_count - 1];
+		} else {
+			devs[open_count].table = register_table_cover(fields);
+		}
+		open_count++;
+	}
+	if (open_count == 0) {
 		ret = -1;
-		//goto exit_restore;
-		restore_serial(fd, &tio);
-		exit(-1);
+		goto exit_close;
+	}
+	if (dev_count > 1) {
+		for (i = 0; i < open_count; i++) {
+			devs[i].tag = devs[i].label;
+		}
+	}
+
+	// trend buckets, sized for the devices that opened. A file kept for
+	// another count is refused rather than laid out again.
+	if (rollup_path != NULL) {
+		ret = rollup_open(&rollup, rollup_path, open_count);
+		if (ret) {
+			goto exit_close;
+		}
+		output_sink_add(rollup_sink, &rollup);
+		output_batch_sink_add(rollup_batch_sink, &rollup);
+	}
+
+	// long term store, one per device to keep each in time order
+	if (store_path != NULL) {
+		for (i = 0; i < open_count; i++) {
+			ret = block_store_open(&stores[i],
+					       device_path(dev_store_path, sizeof(dev_store_path), store_path, &devs[i]));
+			if (ret) {
+				goto exit_close;
+			}
+		}
+		output_sink_add(block_store_sink, stores);
+		output_batch_sink_add(block_store_batch_sink, stores);
+	}
+
+	// http endpoint
+	if (http_port > 0) {
+		ret = http_server_open(&http, http_port, www_root, devs, open_count);
+		if (ret) {
+			goto exit_close;
+		}
+		if (rollup_path != NULL) {
+			http.rollup = &rollup;
+		}
+		if (ring_path != NULL) {
+			http.ring = &ring;
+		}
+		if (store_path != NULL) {
+			http.stores = stores;
+		}
+		output_sink_add(http_server_sink, &http);
 	}
 
 	if (mode == MODE_LATEST) {
 
 #ifdef DEBUG	  
-	        printf("Mode : Get Latest Data.\n");
+	        fprintf(stderr, "Mode : Get Latest Data.\n");
 #endif
-		ret = get_latest_data(fd, csv_path);
+		ret = get_latest_data(devs, open_count, csv_path);
 		if (ret) {
-			printf("get latest data error.\n");
-			goto exit_unlock;
+			fprintf(stderr, "get latest data error.\n");
+			goto exit_close;
 		}
 
 	} else if (mode == MODE_MEMDATA) {
-		printf("Mode : Get Memory Data.\n");
-		ret = get_memory_data(fd, csv_path);
+		if (output_format_get() == OUTPUT_CSV) {
+			fprintf(stderr, "Mode : Get Memory Data.\n");
+		}
+		// a failed device does not keep the others from being read
+		ret = 0;
+		for (i = 0; i < open_count && !is_terminated(); i++) {
+			if (get_memory_data(&devs[i],
+					    device_path(dev_csv_path, sizeof(dev_csv_path), csv_path, &devs[i]),
+					    device_path(dev_state_path, sizeof(dev_state_path), state_path, &devs[i]))) {
+				fprintf(stderr, "%s: get memory data error.\n", devs[i].name);
+				ret = -1;
+			}
+		}
 		if (ret) {
-			printf("get memory data error.\n");
-			goto exit_unlock;
+			goto exit_close;
+		}
+
+	} else if (mode == MODE_DAEMON) {
+
+#ifdef DEBUG
+		fprintf(stderr, "Mode : Daemon.\n");
+#endif
+		ret = run_daemon(devs, open_count, csv_path, interval_ms, stats_sec);
+		if (ret) {
+			fprintf(stderr, "daemon error.\n");
+			goto exit_close;
 		}
 	}
 
 #ifdef DEBUG	  
-	printf("Program all success.\n");
+	fprintf(stderr, "Program all success.\n");
 #endif
-	
-exit_unlock:
-	unlink(lockfile);
-
-exit_restore:
-	restore_serial(fd, &tio);
 
 exit_close:
-	close(fd);
+	if (stats_sec > 0 && open_count > 0) {
+		stats_dump(devs, open_count);
+	}
+	for (i = 0; i < open_count; i++) {
+		device_close(&devs[i]);
+	}
+	http_server_close(&http);
+	for (i = 0; i < open_count; i++) {
+		block_store_close(&stores[i]);
+	}
+	rollup_close(&rollup);
+	ring_file_close(&ring);
 
 	return ret;
 }
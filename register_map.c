@@ -0,0 +1,197 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "register_map.h"
+
+/*
+ * field layouts, offsets into the data after the sequence number
+ *   F(field, sensor_raw_t member, offset, bytes)
+ */
+
+// 4.4.4 Latest data short (Table 84)
+#define TABLE_SHORT(F)				\
+	F(FIELD_TEMP, temp, 0, 2)		\
+	F(FIELD_HUMID, humid, 2, 2)		\
+	F(FIELD_LIGHT, light, 4, 2)		\
+	F(FIELD_PRESS, press, 6, 4)		\
+	F(FIELD_NOISE, noise, 10, 2)		\
+	F(FIELD_TVOC, TVOC, 12, 2)		\
+	F(FIELD_CO2, CO2, 14, 2)		\
+	F(FIELD_DISCOM, discom, 16, 2)		\
+	F(FIELD_HEAT, heat, 18, 2)
+
+// latest sensing data, the environment values only
+#define TABLE_SENSING(F)			\
+	F(FIELD_TEMP, temp, 0, 2)		\
+	F(FIELD_HUMID, humid, 2, 2)		\
+	F(FIELD_LIGHT, light, 4, 2)		\
+	F(FIELD_PRESS, press, 6, 4)		\
+	F(FIELD_NOISE, noise, 10, 2)		\
+	F(FIELD_TVOC, TVOC, 12, 2)		\
+	F(FIELD_CO2, CO2, 14, 2)
+
+// latest calculation data (Table 100), the vibration values are not kept
+#define TABLE_CALC(F)				\
+	F(FIELD_DISCOM, discom, 0, 2)		\
+	F(FIELD_HEAT, heat, 2, 2)
+
+#define FIELD_BYTES_2(p)	((p)[0] | ((p)[1] << 8))
+#define FIELD_BYTES_4(p)	((int32_t)((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((uint32_t)(p)[3] << 24)))
+
+#define DECODE(field, member, offset, bytes)			\
+	raw->member = FIELD_BYTES_##bytes(data + (offset));
+
+#define DECODE_FIELD(field, member, offset, bytes)		\
+	if (fields & (1 << (field))) {				\
+		DECODE(field, member, offset, bytes)		\
+	}
+
+#define FIELD_BIT(field, member, offset, bytes) | (1 << (field))
+
+// every field of the table straight through, or the selected ones
+#define DEFINE_DECODER(name, layout)					\
+static void name(struct sensor_raw_t *raw, const uint8_t *data, unsigned fields) { \
+	if ((fields & (0 layout(FIELD_BIT))) == (0 layout(FIELD_BIT))) { \
+		layout(DECODE)						\
+	} else {							\
+		layout(DECODE_FIELD)					\
+	}								\
+}
+
+DEFINE_DECODER(decode_short, TABLE_SHORT)
+DEFINE_DECODER(decode_sensing, TABLE_SENSING)
+DEFINE_DECODER(decode_calc, TABLE_CALC)
+
+// response frame length: header 7, sequence number, data, crc 2
+static const struct register_table tables[] = {
+	{ "short", 0x5022, 30, 0 TABLE_SHORT(FIELD_BIT), decode_short },
+	{ "sensing", 0x5012, 26, 0 TABLE_SENSING(FIELD_BIT), decode_sensing },
+	{ "calc", 0x5013, 27, 0 TABLE_CALC(FIELD_BIT), decode_calc },
+};
+
+#define TABLE_COUNT	(sizeof(tables) / sizeof(tables[0]))
+
+// field names in FIELD_ order, as in the JSON of the HTTP server
+static const char *const field_names[SENSOR_FIELDS] = {
+	"temp", "humid", "light", "press", "noise", "tvoc", "co2", "discom", "heat",
+};
+
+/*
+ * table by name or register address (e.g. "sensing" or 0x5012)
+ */
+const struct register_table *register_table_find(const char *name) {
+	unsigned long addr;
+	char *end;
+	size_t i;
+
+	addr = strtoul(name, &end, 16);
+	for (i = 0; i < TABLE_COUNT; i++) {
+		if (!strcmp(name, tables[i].name) ||
+		    (*name && !*end && addr == tables[i].addr)) {
+			return &tables[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * all fields, Table 84
+ */
+const struct register_table *register_table_default(void) {
+	return &tables[0];
+}
+
+/*
+ * n-th known table, NULL past the last
+ */
+const struct register_table *register_table_get(int n) {
+	if (n < 0 || n >= (int)TABLE_COUNT) {
+		return NULL;
+	}
+	return &tables[n];
+}
+
+/*
+ * shortest response carrying every field in fields
+ */
+const struct register_table *register_table_cover(unsigned fields) {
+	const struct register_table *best = NULL;
+	size_t i;
+
+	for (i = 0; i < TABLE_COUNT; i++) {
+		if ((tables[i].fields & fields) == fields &&
+		    (best == NULL || tables[i].len < best->len)) {
+			best = &tables[i];
+		}
+	}
+	return best;
+}
+
+const char *register_field_name(int f) {
+	return field_names[f];
+}
+
+/*
+ * comma separated field names to a FIELD_ mask
+ */
+int register_fields_parse(const char *list, unsigned *fields) {
+	const char *p = list;
+	size_t len;
+	int f;
+
+	*fields = 0;
+	while (*p) {
+		len = strcspn(p, ",");
+		for (f = 0; f < SENSOR_FIELDS; f++) {
+			if (strlen(field_names[f]) == len && strncmp(p, field_names[f], len) == 0) {
+				break;
+			}
+		}
+		if (f == SENSOR_FIELDS) {
+			fprintf(stderr, "unknown field %.*s.\n", (int)len, p);
+			return -1;
+		}
+		*fields |= 1 << f;
+		p += len;
+		if (*p == ',') {
+			p++;
+		}
+	}
+	return *fields ? 0 : -1;
+}
+
+/*
+ * sample flags marking the fields not in fields
+ */
+uint16_t register_absent_flags(unsigned fields) {
+	uint16_t flags = 0;
+	int f;
+
+	for (f = 0; f < SENSOR_FIELDS; f++) {
+		if (!(fields & (1 << f))) {
+			flags |= SAMPLE_FLAG_ABSENT(f);
+		}
+	}
+	return flags;
+}
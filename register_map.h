@@ -0,0 +1,57 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __REGISTER_MAP__
+#define __REGISTER_MAP__
+
+#include <stdint.h>
+
+#include "common.h"
+
+#define REGISTER_DATA_OFFSET	(8)	// after the frame header and sequence number
+#define REGISTER_FRAME_MAX	(30)	// longest latest data response
+
+/*
+ * a latest data register
+ * The response carries the fields of the mask, decode() fills those of
+ * them also in fields from the frame data after the sequence number and
+ * leaves the others alone.
+ */
+struct register_table {
+	const char *name;
+	uint16_t addr;
+	uint16_t len;		// response frame length
+	uint16_t fields;	// bit per FIELD_ carried
+	void (*decode)(struct sensor_raw_t *raw, const uint8_t *data, unsigned fields);
+};
+
+const struct register_table *register_table_find(const char *name);
+
+const struct register_table *register_table_default(void);
+
+const struct register_table *register_table_get(int n);
+
+const struct register_table *register_table_cover(unsigned fields);
+
+const char *register_field_name(int f);
+
+int register_fields_parse(const char *list, unsigned *fields);
+
+uint16_t register_absent_flags(unsigned fields);
+
+#endif /* __REGISTER_MAP__ */
@@ -0,0 +1,149 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "data_output.h"
+#include "ring_file.h"
+
+/*
+ * ring file open
+ * An existing ring with the same layout is continued, a ring of another
+ * layout is laid out again with the next generation number. A file that
+ * is neither empty nor a ring file is refused and left as it is.
+ */
+int ring_file_open(struct ring_file *rf, const char *path, uint32_t capacity) {
+	struct ring_header *hdr, old;
+	struct stat st;
+	uint64_t generation = 0;
+	int ret;
+
+	memset(rf, 0, sizeof(*rf));
+	rf->map_len = RING_HEADER_LEN + (size_t)capacity * BIN_RECORD_LEN;
+
+	rf->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (rf->fd < 0) {
+		perror("ring file open");
+		return -1;
+	}
+
+	if (fstat(rf->fd, &st) < 0) {
+		perror("ring file stat");
+		goto exit_close;
+	}
+	memset(&old, 0, sizeof(old));
+	if (st.st_size > 0 &&
+	    (pread(rf->fd, &old, sizeof(old), 0) != (ssize_t)sizeof(old) ||
+	     memcmp(old.magic, RING_MAGIC, 4) != 0)) {
+		fprintf(stderr, "%s is not a ring file, not used.\n", path);
+		goto exit_close;
+	}
+
+	if ((size_t)st.st_size != rf->map_len) {
+		ret = ftruncate(rf->fd, rf->map_len);
+		if (ret < 0) {
+			perror("ring file truncate");
+			goto exit_close;
+		}
+	}
+
+	hdr = mmap(NULL, rf->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, rf->fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("ring file mmap");
+		goto exit_close;
+	}
+	rf->hdr = hdr;
+	rf->records = (uint8_t *)hdr + RING_HEADER_LEN;
+
+	if (st.st_size > 0 && (size_t)st.st_size == rf->map_len &&
+	    old.version == RING_VERSION && old.record_len == BIN_RECORD_LEN &&
+	    old.capacity == capacity) {
+		return 0;
+	}
+
+	if (st.st_size > 0) {
+		generation = old.generation + 1;
+	}
+	memset(hdr, 0, RING_HEADER_LEN);
+	hdr->version = RING_VERSION;
+	hdr->record_len = BIN_RECORD_LEN;
+	hdr->capacity = capacity;
+	hdr->generation = generation;
+	__atomic_store_n(&hdr->head, 0, __ATOMIC_RELEASE);
+	// magic last, a reader never sees a half initialised header as valid
+	memcpy(hdr->magic, RING_MAGIC, 4);
+	return 0;
+
+exit_close:
+	close(rf->fd);
+	rf->fd = -1;
+	return -1;
+}
+
+/*
+ * ring file append
+ * A record copy plus one release store of head. tail moves first when
+ * the oldest slot is about to be overwritten.
+ */
+void ring_file_append(struct ring_file *rf, const struct sensor_sample_t *sample) {
+	struct ring_header *hdr = rf->hdr;
+	uint64_t head;
+
+	if (hdr == NULL) {
+		return;
+	}
+	head = hdr->head;
+	if (head - hdr->tail >= hdr->capacity) {
+		__atomic_store_n(&hdr->tail, head - hdr->capacity + 1, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	bin_format(rf->records + (head % hdr->capacity) * BIN_RECORD_LEN, sample);
+	__atomic_store_n(&hdr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * output sink entry
+ */
+void ring_file_sink(void *ctx, const struct sensor_sample_t *sample) {
+	ring_file_append(ctx, sample);
+}
+
+/*
+ * ring file close
+ */
+void ring_file_close(struct ring_file *rf) {
+	if (rf->hdr != NULL) {
+		msync(rf->hdr, rf->map_len, MS_SYNC);
+		munmap(rf->hdr, rf->map_len);
+		rf->hdr = NULL;
+	}
+	if (rf->fd >= 0) {
+		close(rf->fd);
+		rf->fd = -1;
+	}
+}
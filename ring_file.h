@@ -0,0 +1,66 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __RING_FILE__
+#define __RING_FILE__
+
+#include <stdint.h>
+
+#include "common.h"
+
+#define RING_MAGIC		"2JCR"
+#define RING_VERSION		(1)
+#define RING_HEADER_LEN		(64)
+#define RING_DEFAULT_RECORDS	(7 * 24 * 60 * 60)	// 7 days of 1 sec samples
+
+/*
+ * ring file header, host byte order, at offset 0 of the file
+ * Records of BIN_RECORD_LEN bytes follow at RING_HEADER_LEN. head counts
+ * every record ever appended, record n lives in slot n % capacity and
+ * tail is the oldest record still held. Readers map the file read-only,
+ * load head, copy records and then check tail to see whether the writer
+ * lapped them meanwhile.
+ */
+struct ring_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t record_len;
+	uint32_t capacity;
+	uint32_t reserved;
+	uint64_t generation;	// bumped whenever the file is laid out anew
+	uint64_t head;
+	uint64_t tail;
+	uint8_t pad[RING_HEADER_LEN - 40];
+};
+
+struct ring_file {
+	int fd;
+	size_t map_len;
+	struct ring_header *hdr;
+	uint8_t *records;
+};
+
+int ring_file_open(struct ring_file *rf, const char *path, uint32_t capacity);
+
+void ring_file_append(struct ring_file *rf, const struct sensor_sample_t *sample);
+
+void ring_file_sink(void *ctx, const struct sensor_sample_t *sample);
+
+void ring_file_close(struct ring_file *rf);
+
+#endif /* __RING_FILE__ */
@@ -0,0 +1,319 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "rollup.h"
+
+static const uint64_t level_width_ms[ROLLUP_LEVELS] = {
+	60 * 1000ULL,
+	60 * 60 * 1000ULL,
+	24 * 60 * 60 * 1000ULL,
+};
+
+static const uint32_t level_buckets[ROLLUP_LEVELS] = {
+	ROLLUP_MINUTE_BUCKETS,
+	ROLLUP_HOUR_BUCKETS,
+	ROLLUP_DAY_BUCKETS,
+};
+
+static const char *level_names[ROLLUP_LEVELS] = { "minute", "hour", "day" };
+
+/*
+ * level by name, -1 if unknown
+ */
+int rollup_level_parse(const char *name, size_t len) {
+	int i;
+
+	for (i = 0; i < ROLLUP_LEVELS; i++) {
+		if (strlen(level_names[i]) == len && strncmp(name, level_names[i], len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+uint64_t rollup_width_ms(int level) {
+	return level_width_ms[level];
+}
+
+/*
+ * version 1 buckets counted every field in every sample
+ */
+static void upgrade_v1(struct rollup *r, size_t buckets) {
+	struct rollup_bucket *b = r->level[0];
+	size_t n;
+	int i;
+
+	for (n = 0; n < buckets; n++, b++) {
+		for (i = 0; i < ROLLUP_FIELDS; i++) {
+			b->f[i].count = b->count;
+		}
+	}
+	r->hdr->version = ROLLUP_VERSION;
+}
+
+/*
+ * rollup file open
+ * An empty file is laid out for devices. An existing one is continued
+ * when it has the same layout, a version 1 one after filling in the field
+ * counts. Anything else is refused and left as it is, e.g. a file kept
+ * for another device count, so its history is not lost.
+ */
+int rollup_open(struct rollup *r, const char *path, int devices) {
+	struct rollup_header *hdr, old;
+	struct rollup_bucket *b;
+	struct stat st;
+	size_t buckets = 0;
+	int i, ret;
+
+	memset(r, 0, sizeof(*r));
+	for (i = 0; i < ROLLUP_LEVELS; i++) {
+		buckets += (size_t)level_buckets[i] * devices;
+	}
+	r->map_len = ROLLUP_HEADER_LEN + buckets * sizeof(struct rollup_bucket);
+
+	r->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (r->fd < 0) {
+		perror("rollup file open");
+		return -1;
+	}
+
+	if (fstat(r->fd, &st) < 0) {
+		perror("rollup file stat");
+		goto exit_close;
+	}
+	if (st.st_size > 0) {
+		if (pread(r->fd, &old, sizeof(old), 0) != (ssize_t)sizeof(old) ||
+		    memcmp(old.magic, ROLLUP_MAGIC, 4) != 0 ||
+		    (old.version != ROLLUP_VERSION && old.version != 1) ||
+		    old.bucket_len != sizeof(struct rollup_bucket) ||
+		    memcmp(old.buckets, level_buckets, sizeof(level_buckets)) != 0) {
+			fprintf(stderr, "%s is not a rollup file, not used.\n", path);
+			goto exit_close;
+		}
+		if (old.devices != (uint32_t)devices || (size_t)st.st_size != r->map_len) {
+			fprintf(stderr, "%s holds %u devices, not %d, not used.\n", path, old.devices, devices);
+			goto exit_close;
+		}
+	} else {
+		ret = ftruncate(r->fd, r->map_len);
+		if (ret < 0) {
+			perror("rollup file truncate");
+			goto exit_close;
+		}
+	}
+
+	hdr = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("rollup file mmap");
+		goto exit_close;
+	}
+	r->hdr = hdr;
+	b = (struct rollup_bucket *)((uint8_t *)hdr + ROLLUP_HEADER_LEN);
+	for (i = 0; i < ROLLUP_LEVELS; i++) {
+		r->level[i] = b;
+		b += (size_t)level_buckets[i] * devices;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+
+	if (st.st_size > 0) {
+		if (hdr->version == 1) {
+			upgrade_v1(r, buckets);
+		}
+		return 0;
+	}
+
+	// a new file reads as zero, only the header is set
+	hdr->version = ROLLUP_VERSION;
+	hdr->bucket_len = sizeof(struct rollup_bucket);
+	hdr->devices = devices;
+	memcpy(hdr->buckets, level_buckets, sizeof(level_buckets));
+	memcpy(hdr->magic, ROLLUP_MAGIC, 4);
+	return 0;
+
+exit_close:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+/*
+ * slot of bucket n
+ */
+static struct rollup_bucket *bucket_slot(struct rollup *r, int level, int device, uint64_t n) {
+	return &r->level[level][(size_t)device * level_buckets[level] + n % level_buckets[level]];
+}
+
+/*
+ * add one record to every level
+ * A record older than what its slot already holds has aged out and is
+ * dropped, a newer one starts the slot over. Fields flagged absent are
+ * left out.
+ */
+static void add_values(struct rollup *r, int device, uint64_t time_ms, uint16_t flags, const int32_t *v) {
+	struct rollup_bucket *b;
+	struct rollup_field *f;
+	uint64_t start;
+	int level, i;
+
+	if (r->hdr == NULL || device >= (int)r->hdr->devices) {
+		return;
+	}
+
+	for (level = 0; level < ROLLUP_LEVELS; level++) {
+		start = time_ms - time_ms % level_width_ms[level];
+		b = bucket_slot(r, level, device, time_ms / level_width_ms[level]);
+		if (b->count > 0 && b->start_ms > start) {
+			continue;
+		}
+		if (b->count == 0 || b->start_ms < start) {
+			b->start_ms = start;
+			b->count = 0;
+			for (i = 0; i < ROLLUP_FIELDS; i++) {
+				b->f[i].count = 0;
+				b->f[i].sum = 0;
+			}
+		}
+		for (i = 0; i < ROLLUP_FIELDS; i++) {
+			f = &b->f[i];
+			if (flags & SAMPLE_FLAG_ABSENT(i)) {
+				continue;
+			}
+			if (f->count == 0 || v[i] < f->min) {
+				f->min = v[i];
+			}
+			if (f->count == 0 || v[i] > f->max) {
+				f->max = v[i];
+			}
+			f->sum += v[i];
+			f->last = v[i];
+			f->count++;
+		}
+		b->count++;
+	}
+}
+
+/*
+ * add a sample
+ */
+void rollup_add(struct rollup *r, const struct sensor_sample_t *sample) {
+	const struct sensor_raw_t *raw = &sample->raw;
+	int32_t v[ROLLUP_FIELDS] = {
+		raw->temp, raw->humid, raw->light, raw->press, raw->noise,
+		raw->TVOC, raw->CO2, raw->discom, raw->heat,
+	};
+
+	pthread_mutex_lock(&r->lock);
+	add_values(r, sample->device_id, sample->time_ms, sample->flags, v);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * add every record of a batch
+ */
+void rollup_add_batch(struct rollup *r, const struct sensor_batch *b) {
+	int32_t v[ROLLUP_FIELDS];
+	uint32_t i;
+
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < b->count; i++) {
+		v[0] = b->temp[i];
+		v[1] = b->humid[i];
+		v[2] = b->light[i];
+		v[3] = b->press[i];
+		v[4] = b->noise[i];
+		v[5] = b->TVOC[i];
+		v[6] = b->CO2[i];
+		v[7] = b->discom[i];
+		v[8] = b->heat[i];
+		add_values(r, b->device_id, b->time_ms[i], b->flags, v);
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * bucket n of a device, NULL when the slot does not hold it
+ * Call between rollup_lock() and rollup_unlock().
+ */
+const struct rollup_bucket *rollup_bucket(struct rollup *r, int level, int device, uint64_t n) {
+	struct rollup_bucket *b;
+
+	if (r->hdr == NULL || device < 0 || device >= (int)r->hdr->devices) {
+		return NULL;
+	}
+	b = bucket_slot(r, level, device, n);
+	if (b->count == 0 || b->start_ms != n * level_width_ms[level]) {
+		return NULL;
+	}
+	return b;
+}
+
+void rollup_lock(struct rollup *r) {
+	pthread_mutex_lock(&r->lock);
+}
+
+void rollup_unlock(struct rollup *r) {
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * output sink entries
+ */
+void rollup_sink(void *ctx, const struct sensor_sample_t *sample) {
+	rollup_add(ctx, sample);
+}
+
+/*
+ * memory data is left out: its time is the device time counter, which
+ * the buckets of wall clock time cannot place
+ */
+void rollup_batch_sink(void *ctx, const struct sensor_batch *b) {
+	if (b->flags & SAMPLE_FLAG_MEMORY) {
+		return;
+	}
+	rollup_add_batch(ctx, b);
+}
+
+/*
+ * rollup file close
+ */
+void rollup_close(struct rollup *r) {
+	if (r->hdr != NULL) {
+		msync(r->hdr, r->map_len, MS_SYNC);
+		munmap(r->hdr, r->map_len);
+		r->hdr = NULL;
+		pthread_mutex_destroy(&r->lock);
+	}
+	if (r->fd >= 0) {
+		close(r->fd);
+		r->fd = -1;
+	}
+}
@@ -0,0 +1,113 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ROLLUP__
+#define __ROLLUP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "common.h"
+
+#define ROLLUP_MAGIC		"2JCU"
+#define ROLLUP_VERSION		(2)	// 1 had no per field count
+#define ROLLUP_HEADER_LEN	(64)
+#define ROLLUP_FIELDS		(9)	// Table84 fields, in sensor_raw_t order
+
+// resolutions
+#define ROLLUP_MINUTE		(0)
+#define ROLLUP_HOUR		(1)
+#define ROLLUP_DAY		(2)
+#define ROLLUP_LEVELS		(3)
+
+// buckets kept per device
+#define ROLLUP_MINUTE_BUCKETS	(7 * 24 * 60)	// 7 days
+#define ROLLUP_HOUR_BUCKETS	(92 * 24)	// 3 months
+#define ROLLUP_DAY_BUCKETS	(5 * 366)	// 5 years
+
+struct rollup_field {
+	int32_t min;
+	int32_t max;
+	int32_t last;
+	uint32_t count;		// samples carrying the field
+	int64_t sum;
+};
+
+/*
+ * one time bucket, raw sensor units like struct sensor_raw_t
+ * mean is sum / count of the field, a field no sample carried
+ * (SAMPLE_FLAG_ABSENT) has a count of 0.
+ */
+struct rollup_bucket {
+	uint64_t start_ms;	// bucket start, 0 while unused
+	uint32_t count;
+	uint32_t reserved;
+	struct rollup_field f[ROLLUP_FIELDS];
+};
+
+/*
+ * rollup file header, host byte order, at offset 0 of the file
+ * The buckets follow at ROLLUP_HEADER_LEN, level by level, and inside a
+ * level device by device. Bucket n (start_ms / width) of a device lives
+ * in slot n % buckets[level].
+ */
+struct rollup_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t bucket_len;
+	uint32_t devices;
+	uint32_t buckets[ROLLUP_LEVELS];
+	uint8_t pad[ROLLUP_HEADER_LEN - 24];
+};
+
+/*
+ * streaming min/max/mean/last per field at minute, hour and day buckets,
+ * kept in an mmap'ed file so they survive restarts
+ */
+struct rollup {
+	int fd;
+	size_t map_len;
+	struct rollup_header *hdr;
+	struct rollup_bucket *level[ROLLUP_LEVELS];
+	pthread_mutex_t lock;	// memory data is added from the writer thread
+};
+
+int rollup_level_parse(const char *name, size_t len);
+
+uint64_t rollup_width_ms(int level);
+
+int rollup_open(struct rollup *r, const char *path, int devices);
+
+void rollup_add(struct rollup *r, const struct sensor_sample_t *sample);
+
+void rollup_add_batch(struct rollup *r, const struct sensor_batch *b);
+
+const struct rollup_bucket *rollup_bucket(struct rollup *r, int level, int device, uint64_t n);
+
+void rollup_lock(struct rollup *r);
+
+void rollup_unlock(struct rollup *r);
+
+void rollup_sink(void *ctx, const struct sensor_sample_t *sample);
+
+void rollup_batch_sink(void *ctx, const struct sensor_batch *b);
+
+void rollup_close(struct rollup *r);
+
+#endif /* __ROLLUP__ */
@@ -17,11 +17,13 @@
  */
 
 #include <sys/types.h>
-#include <sys/select.h>
+#include <pthread.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <limits.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,11 +33,17 @@
 #include <time.h>
 
 #include "common.h"
+#include "batch_decode.h"
+#include "cmd_queue.h"
+#include "crc16.h"
 #include "data_output.h"
-
-//crc16 format
-#define CRC16POLY               (0xa001)
-#define CRC_INIT                (0xffff)
+#include "device.h"
+#include "frame_reader.h"
+#include "link_retry.h"
+#include "register_map.h"
+#include "sensor_data.h"
+#include "spsc_ring.h"
+#include "stats.h"
 
 //data length
 #define LEN_W_LATEST            (9)
@@ -50,32 +58,34 @@
 #define CMD_WRITE               (0x02)   // Table72 not used in this program
 #define LATEST_LEN              (0x0005)
 
-
-///// Table 84の内容
-#define LATEST_ADDR             (0x5022) // Table84
-#define LEN_R_LATEST            (30)  // 一時コメントアウト
-
-///// Table 100の内容
-//#define LATEST_ADDR             (0x5013) // Table 100
-//#define LEN_R_LATEST            (27) // LATEST_ADDR が 0x5013
-
-///// Table 103の内容
-// #define LATEST_ADDR             (0x5016) // Table 103
-// #define LEN_R_LATEST            (24) // LATEST_ADDR が 0x5016
-
-
+// the latest data register and its length come from the device table (register_map.h)
 
 #define INFO_LEN                (0x0005)  // Table71
 #define INFO_ADDR               (0x5004)
 #define MEMORY_LEN              (0x000D)
 #define MEMORY_ADDR             (0x500F) // 4.4.2 Memory data short
+#define STATUS_LEN              (0x0005)
+#define STATUS_ADDR             (0x5401) // error status, a bit per failed sensor
+#define LEN_R_STATUS            (10)
 
 #define MAX_RETRY				(10)
 
+// get_latest_data() device state
+#define LATEST_PENDING			(0)
+#define LATEST_DONE			(1)
+#define LATEST_FAILED			(2)
+#define LATEST_SKIPPED			(3)	// degraded link, not probed this time
+
+#define MEMDATA_WINDOW			(SENSOR_BATCH_MAX)	// records requested per memory data command
+#define MEMDATA_STDOUT_MAX		(101)	// records shown when no csv path is given
+#define MEMDATA_PIPE_SLOTS		(4)	// windows in flight between two stages
+#define MEMDATA_RECORD_US		(LEN_R_MEMDATA_ONE * 10 * 1000000 / 115200)	// one record at 115200 8N1
+
 #define __unused __attribute__((unused))
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 static int terminated = 0;
+static int read_status = 0;
 
 /*
  * signal handler
@@ -110,6 +120,13 @@ int install_sig_handler(void) {
 	return 0;
 }
 
+/*
+ * termination request check
+ */
+int is_terminated(void) {
+	return terminated;
+}
+
 /*
  * buffer print
  * debug function
@@ -126,10 +143,12 @@ static void dump_buff(unsigned char *buff, int len) {
 
 /*
  * write
+ * The port is non-blocking, a full output queue is waited out with poll.
  */
 static ssize_t xwrite(int fd, void *buf, size_t count) {
 	size_t len;
 	ssize_t ret = -1;
+	struct pollfd pfd;
 
 #ifdef DEBUG
 	printf("-------\n");	
@@ -145,149 +164,140 @@ static ssize_t xwrite(int fd, void *buf, size_t count) {
 				ret = 0;
 				continue;
 			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, FRAME_TIMEOUT_MS) > 0) {
+					ret = 0;
+					continue;
+				}
+			}
 			perror("write");
-			return ret;
+			return -1;
 		}
 	}
 	return ret;
 }
 
 /*
- * read
+ * response address check
  */
-static ssize_t xread(int fd, void *buf, size_t count) {
-	size_t len;
-	ssize_t ret = -1;
-
-#ifdef DEBUG
-	printf("-------\n");	
-	printf("xread()\n");
-	printf("-------\n");	
-#endif
-	
-	
-	for (len = 0; len < count; len += ret) {
-	  ret = read(fd, buf + len, count - len);
-		if (ret < 0) {
-			if (errno == EINTR && !terminated) {
-				ret = 0;
-				continue;
-			}
-			perror("read");
-			return ret;
-		}
-	}
-	return ret;
+static int frame_is_response(uint8_t *wbuf, uint8_t *frame) {
+	return frame[5] == wbuf[5] && frame[6] == wbuf[6];
 }
 
 /*
- * select
+ * msec since start_ns
  */
- static int xselect(int fd ,struct timeval tv, fd_set fds) {
-	 int rc = 0;
-
-	 tv.tv_sec = 1;
-	 tv.tv_usec = 0;
-
-#ifdef DEBUG
-	 printf("---------\n");	
-	 printf("xselect()\n");
-	 printf("---------\n");		 
-#endif
-
-	 rc = select(fd+1, &fds, NULL, NULL, &tv);
-	 if (rc < 0) {
-		 perror("select");
-		 return -1;
-	 }
-	 if (rc == 0) {
-		 printf("CAUTION: time out.\n");
-		 return 0;
-	 }
-
-	 return 1;
- }
+static long elapsed_ms(uint64_t start_ns) {
+	return (stats_now_ns() - start_ns) / 1000000;
+}
 
 /*
  * usb communication
+ * Sends the command and waits for its response frame. Leftovers of an
+ * earlier command and frames for another address are dropped. Timeouts
+ * and re-sends follow the link retry policy, the backoff is spent in
+ * poll() so the poll hooks are still served. Round trips, timeouts and
+ * attempts go to the link stats.
  */
-static int communicate_command(int fd, uint8_t *wbuf, size_t wcount,uint8_t *rbuf, size_t rcount) {
+static int communicate_command(struct sensor_device *dev, uint8_t *wbuf, size_t wcount,
+			       uint8_t **rframe, size_t *rlen) {
+	struct frame_reader *fr = &dev->reader;
+	struct link_stats *ls = &dev->stats;
+	struct link_retry *lr = &dev->retry;
 	ssize_t ret;
-	int sel_ret = 0;
-	struct timeval tv = {0};
-	fd_set fds;
-	int i = 0;
-
-	FD_ZERO(&fds);
-	FD_SET(fd,&fds);
-
-	for (i = 0; i < MAX_RETRY; i++) { // MAX_RETRYは10
+	int wait_ret;
+	int attempt;
+	uint64_t start_ns, sent_ns;
+
+	start_ns = stats_now_ns();
+	for (attempt = 0; ; attempt++) {
+		if (attempt > 0) {
+			if (!link_retry_again(lr, attempt, elapsed_ms(start_ns))) {
+				break;
+			}
+			if (frame_reader_poll(NULL, 0, link_retry_backoff_ms(lr, attempt)) < 0 || terminated) {
+				break;
+			}
+		}
 
-		ret = xwrite(fd, wbuf, wcount);
+		frame_reader_reset(fr);
+		ret = xwrite(fr->fd, wbuf, wcount);
 		if (ret < 0) {
 			continue;
 		}
+		sent_ns = stats_now_ns();
+
+		frame_reader_arm(fr, link_retry_timeout_ms(lr, attempt));
+		do {
+			wait_ret = frame_reader_wait(fr, rframe, rlen);
+		} while (wait_ret == FRAME_READY && !frame_is_response(wbuf, *rframe));
 
-		sel_ret = xselect(fd, tv, fds);
-		if (sel_ret == 0) {
+		if (wait_ret == FRAME_TIMEOUT) {
+			fprintf(stderr, "CAUTION: %s time out.\n", dev->name);
+			ls->timeouts++;
 			continue;
 		}
-
-		break;
-	}
-
-	if (sel_ret < 0) {
-		return -1;
-	}
-
-	if (FD_ISSET(fd, &fds)) {
-		ret = xread(fd, rbuf, rcount);
-		if (ret < 0) {
+		if (wait_ret == FRAME_ERROR || terminated) {
+			attempt++;
+			break;
+		}
+		stats_histogram_add(&ls->rtt_us, (stats_now_ns() - sent_ns) / 1000);
+		link_retry_rtt(lr, (stats_now_ns() - sent_ns) / 1000);
+
+		// error response (Table72 command | 0x80)
+		if ((*rframe)[4] & 0x80) {
+			fprintf(stderr, "device error response. code %02x\n", (*rframe)[7]);
+			ls->error_responses++;
+			stats_link_command(ls, attempt + 1, 0);
+			link_retry_result(lr, 1, dev->name);
 			return -1;
 		}
+		stats_link_command(ls, attempt + 1, 1);
+		link_retry_result(lr, 1, dev->name);
+		return 0;
 	}
 
-	return 0;
+	stats_link_command(ls, attempt, 0);
+	if (!terminated) {
+		link_retry_result(lr, 0, dev->name);
+	}
+	return -1;
 }
 
 /*
- * crc16 bit Calc
+ * Table84 sensing data decode
  */
-static unsigned short crc16_bit_calc(unsigned char *ptr, int len) {
-	int i,j;
-	unsigned short crc = CRC_INIT;
-	for (i = 0; i < len; i++) {
-		crc ^= ptr[i];
-		for (j=0; j < 8; j++) {
-			if (crc & 1) {
-				crc = (crc >> 1) ^ CRC16POLY;
-			} else {
-				crc >>= 1;
-			}
-		}
-	}
-	return crc;
+void sensor_raw_decode(struct sensor_raw_t *raw, const uint8_t *buf) {
+	register_table_default()->decode(raw, buf, FIELDS_ALL);
 }
 
 /*
  * data analyses
+ * Only the output fields are decoded, those left out or not carried by
+ * the table are zero and flagged absent.
  */
-static void data_analyses(FILE *output_file, uint8_t *buf) {
-	struct senser_data_t data;
+static void data_analyses(struct data_writer *writer, const char *tag, struct sensor_sample_t *sample,
+			  const struct register_table *table, uint8_t *buf) {
+	unsigned fields = table->fields & output_fields_get();
 
 	// set data
-	// ここはTable84
-	data.temp = (float)(buf[0] | (buf[1] << 8)) / 100;
-	data.humid = (float)(buf[2] | (buf[3] << 8)) /100;
-	data.light = (int)(buf[4] | (buf[5] << 8));
-	data.press = (double)(buf[6] | (buf[7] << 8) | (buf[8] << 16) | (buf[9] << 24)) / 1000;
-	data.noise = (float)(buf[10] | (buf[11] << 8)) / 100;
-	data.TVOC = (int)(buf[12] | (buf[13] << 8));
-	data.CO2 = (int)(buf[14] | (buf[15] << 8));
-	data.discom = (float)(buf[16] | (buf[17] << 8)) / 100;
-	data.heat = (float)(buf[18] | (buf[19] << 8)) / 100;
-
-	usb_data_output(output_file, data);
+	memset(&sample->raw, 0, sizeof(sample->raw));
+	table->decode(&sample->raw, buf, fields);
+	sample->flags |= register_absent_flags(fields);
+
+	usb_data_output(writer, tag, sample);
+}
+
+/*
+ * wall clock in msec
+ */
+static uint64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /*
@@ -304,7 +314,7 @@ static void short_comm_create(unsigned char *write_frame, unsigned short len, un
 	write_frame[5] = addr & 0x00ff;	// Payload : address low addrは5022 4.4.4 Latest data short
 	write_frame[6] = addr >> 8;	// Payload : address high
 	
-	crc16 = crc16_bit_calc(write_frame,LEN_W_LATEST-2);
+	crc16 = crc16_calc(write_frame,LEN_W_LATEST-2);
 	write_frame[7] = crc16 & 0x00ff;
 	write_frame[8] = crc16 >> 8;
 
@@ -315,65 +325,269 @@ static void short_comm_create(unsigned char *write_frame, unsigned short len, un
 }
 
 
+/*
+ * send what the command queue lets go
+ * started: the answer on the wire is far enough along for the next request
+ */
+static int send_queued(struct sensor_device *dev, int started) {
+	struct cmd_entry *e;
+
+	while ((e = cmd_queue_ready(&dev->cmds, started)) != NULL) {
+		if (xwrite(dev->fd, e->frame, e->len) < 0) {
+			return -1;
+		}
+		cmd_queue_sent(&dev->cmds, stats_now_ns());
+	}
+	return 0;
+}
+
+/*
+ * queue the latest data read
+ * With the status read enabled it is followed by the error status
+ * register, both go out back to back and are answered as one.
+ */
+static void queue_latest_request(struct sensor_device *dev) {
+	struct cmd_entry *e;
+
+	cmd_queue_init(&dev->cmds);
+	e = cmd_queue_add(&dev->cmds, LEN_W_LATEST, 1);
+	short_comm_create(e->frame, LATEST_LEN, CMD_READ, dev->table->addr);
+	if (read_status) {
+		e = cmd_queue_add(&dev->cmds, LEN_W_LATEST, 1);
+		short_comm_create(e->frame, STATUS_LEN, CMD_READ, STATUS_ADDR);
+	}
+}
+
+/*
+ * (re)send what is not answered yet
+ */
+static int send_latest_request(struct sensor_device *dev, int attempt) {
+	frame_reader_reset(&dev->reader);
+	cmd_queue_rewind(&dev->cmds);
+	if (send_queued(dev, 0)) {
+		return -1;
+	}
+	frame_reader_arm(&dev->reader, link_retry_timeout_ms(&dev->retry, attempt));
+	return 0;
+}
+
+/*
+ * also read the error status register with every latest data
+ */
+void latest_status_set(int enable) {
+	read_status = enable;
+}
+
 /*
  * get latest data
+ * The request goes out to every device at once and the responses are
+ * gathered in a single poll loop, so a slow or dead port only delays
+ * itself. A timed out device waits out its backoff inside the same loop
+ * and a degraded one is only probed now and then (see link_retry.h).
+ * Samples are written in device order once all are settled. Without any
+ * sample the output file is not touched and -1 is returned.
  */
-int get_latest_data(int fd, const char *csv_path) {
-	static unsigned char write_frame[20];
-	static unsigned char *read_frame;
-	unsigned short crc16, checkcrc;
+int get_latest_data(struct sensor_device *devs, int count, const char *csv_path) {
+	static unsigned char latest[MAX_DEVICES][REGISTER_FRAME_MAX];
+	static int state[MAX_DEVICES];
+	static int retry[MAX_DEVICES];
+	static int backoff[MAX_DEVICES];	// waiting to re-send
+	static int answered[MAX_DEVICES];
+	static int got_latest[MAX_DEVICES];
+	static uint64_t first_ns[MAX_DEVICES];
+	struct link_retry *lr;
+	struct frame_reader *readers[MAX_DEVICES];
+	struct frame_reader *fr;
+	struct cmd_entry *e;
+	unsigned char *read_frame;
+	size_t read_len;
+	static uint64_t latest_time[MAX_DEVICES];
+	static int bin_stdout_started;
+	static struct data_writer writer;
+	struct sensor_sample_t sample;
+	long msec, timeout;
+	uint64_t start_ns;
+	int i, pending = 0, ready = 0;
 	int ret = 0;
 	FILE *output_file;
 
-	read_frame = (unsigned char *)malloc(LEN_R_LATEST);
-	short_comm_create(write_frame, LATEST_LEN, CMD_READ, LATEST_ADDR);
+	if (count > MAX_DEVICES) {
+		count = MAX_DEVICES;
+	}
 
-#ifdef DEBUG
-	printf("in get_latest_data() after short_comm_create()\n");
-	dump_buff(write_frame, LEN_W_LATEST);
-#endif
-	ret = communicate_command(fd, write_frame, LEN_W_LATEST, read_frame, LEN_R_LATEST);
-	if (ret) {
-		printf("command communication failed.\n");
-		ret = -1;
-		goto exit_free;
+	for (i = 0; i < count; i++) {
+		retry[i] = 0;
+		backoff[i] = 0;
+		answered[i] = 0;
+		got_latest[i] = 0;
+		state[i] = LATEST_PENDING;
+		if (!link_retry_due(&devs[i].retry)) {
+			state[i] = LATEST_SKIPPED;
+			continue;
+		}
+		first_ns[i] = stats_now_ns();
+		queue_latest_request(&devs[i]);
+		if (send_latest_request(&devs[i], 0)) {
+			state[i] = LATEST_FAILED;
+			stats_link_command(&devs[i].stats, 0, 0);
+			link_retry_result(&devs[i].retry, 0, devs[i].name);
+			continue;
+		}
+		pending++;
 	}
+
+	while (pending > 0 && !terminated) {
+		timeout = FRAME_TIMEOUT_MS;
+		for (i = 0; i < count; i++) {
+			readers[i] = NULL;
+			if (state[i] == LATEST_PENDING) {
+				readers[i] = &devs[i].reader;
+				msec = frame_reader_remaining_ms(readers[i]);
+				if (msec < timeout) {
+					timeout = msec;
+				}
+			}
+		}
+		if (frame_reader_poll(readers, count, timeout) < 0) {
+			break;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (state[i] != LATEST_PENDING) {
+				continue;
+			}
+			fr = &devs[i].reader;
+			lr = &devs[i].retry;
+
+			while (state[i] == LATEST_PENDING && frame_reader_next(fr, &read_frame, &read_len)) {
+				e = cmd_queue_answer(&devs[i].cmds, read_frame);
+				if (e == NULL) {
+					continue;
+				}
 #ifdef DEBUG
-	printf("in get_latest_data() after communicate_command()\n");	
-	dump_buff(read_frame, LEN_R_LATEST);
+				printf("in get_latest_data() after frame_reader_next()\n");
+				dump_buff(read_frame, read_len);
 #endif
-	// crc16 check
-	crc16 = crc16_bit_calc(read_frame, LEN_R_LATEST-2);
-	checkcrc = read_frame[LEN_R_LATEST-1] << 8 | read_frame[LEN_R_LATEST-2];
-	if (crc16 != checkcrc) {
-		printf("crc16 check failed.\n");
-		ret = -1;
-		goto exit_free;
+				stats_histogram_add(&devs[i].stats.rtt_us, (stats_now_ns() - e->sent_ns) / 1000);
+				link_retry_rtt(lr, (stats_now_ns() - e->sent_ns) / 1000);
+				answered[i] = 1;
+				if (e->frame[5] == (STATUS_ADDR & 0xff) && e->frame[6] == (STATUS_ADDR >> 8)) {
+					// a sensor without the register keeps its samples unmarked
+					if (read_len < LEN_R_STATUS || (read_frame[4] & 0x80)) {
+						if (devs[i].status != -2) {
+							fprintf(stderr, "%s: no error status.\n", devs[i].name);
+						}
+						devs[i].status = -2;
+					} else {
+						devs[i].status = read_frame[7];
+					}
+				} else if (read_len != devs[i].table->len || (read_frame[4] & 0x80)) {
+					fprintf(stderr, "%s: unexpected response.\n", devs[i].name);
+					devs[i].stats.error_responses++;
+					state[i] = LATEST_FAILED;
+				} else {
+					memcpy(latest[i], read_frame, read_len);
+					latest_time[i] = now_ms();
+					got_latest[i] = 1;
+				}
+				if (state[i] == LATEST_PENDING) {
+					frame_reader_arm(fr, link_retry_timeout_ms(lr, retry[i]));
+				}
+			}
+			if (state[i] == LATEST_PENDING && cmd_queue_pending(&devs[i].cmds) == 0) {
+				state[i] = got_latest[i] ? LATEST_DONE : LATEST_FAILED;
+			}
+			// the status read follows once the latest data answer begins
+			if (state[i] == LATEST_PENDING && !backoff[i] &&
+			    send_queued(&devs[i], frame_reader_partial(fr) > 0)) {
+				state[i] = LATEST_FAILED;
+			}
+			if (state[i] == LATEST_PENDING) {
+				if (fr->failed) {
+					state[i] = LATEST_FAILED;
+				} else if (frame_reader_remaining_ms(fr) == 0 && backoff[i]) {
+					backoff[i] = 0;
+					if (send_latest_request(&devs[i], retry[i])) {
+						state[i] = LATEST_FAILED;
+					}
+				} else if (frame_reader_remaining_ms(fr) == 0) {
+					fprintf(stderr, "CAUTION: %s time out.\n", devs[i].name);
+					devs[i].stats.timeouts++;
+					if (!link_retry_again(lr, retry[i] + 1, elapsed_ms(first_ns[i]))) {
+						state[i] = LATEST_FAILED;
+					} else {
+						// a late answer still counts while backing off
+						backoff[i] = 1;
+						frame_reader_arm(fr, link_retry_backoff_ms(lr, ++retry[i]));
+					}
+				}
+			}
+			if (state[i] != LATEST_PENDING) {
+				stats_link_command(&devs[i].stats, retry[i] + 1 - backoff[i], state[i] == LATEST_DONE);
+				link_retry_result(lr, answered[i], devs[i].name);
+				pending--;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (state[i] == LATEST_DONE) {
+			ready++;
+		} else if (state[i] != LATEST_SKIPPED) {
+			if (!terminated) {
+				fprintf(stderr, "%s: command communication failed.\n", devs[i].name);
+			}
+			ret = -1;
+		}
 	}
 
+	// nothing read, the previous file stays as it is
+	if (ready == 0) {
+		return -1;
+	}
+
+	start_ns = stats_now_ns();
 	if (csv_path != NULL) {
 		output_file = fopen(csv_path, "w");
 	} else {
 		output_file = stdout;
 	}
 	if (output_file == NULL) {
-		printf("output file open failed.\n");
-		ret = -1;
-		goto exit_free;
+		fprintf(stderr, "output file open failed.\n");
+		return -1;
 	}
 
+	data_writer_init(&writer, output_file);
+
+	// a binary stream starts with its file header, on standard output once
+	if (writer.format == OUTPUT_BIN) {
+		if (csv_path != NULL || !bin_stdout_started) {
+			header_output(&writer, 0);
+			bin_stdout_started = (csv_path == NULL);
+		}
+	}
 #ifdef DEBUG
-	header_output(output_file); // 項目の見出しの作成
+	else {
+		header_output(&writer, devs[0].tag != NULL); // 項目の見出しの作成
+	}
 #endif
 
-	data_analyses(output_file, read_frame + 8);
+	for (i = 0; i < count; i++) {
+		if (state[i] != LATEST_DONE) {
+			continue;
+		}
+		sample.time_ms = latest_time[i];
+		sample.device_id = devs[i].id;
+		sample.flags = devs[i].status > 0 ? SAMPLE_FLAG_SENSOR_ERROR : 0;
+		data_analyses(&writer, devs[i].tag, &sample, devs[i].table, latest[i] + REGISTER_DATA_OFFSET);
+		output_sink_publish(&sample);
+	}
+	data_writer_flush(&writer);
 
 	if (csv_path != NULL) {
 	        fclose(output_file);
 	}
-
-exit_free:
-	free(read_frame);
+	stats_histogram_add(&pipeline_stats.write_ns, stats_now_ns() - start_ns);
 
 	return ret;
 }
@@ -381,11 +595,9 @@ exit_free:
 /*
  * long_comm_create
  */
-static int long_comm_create(unsigned char *write_frame, unsigned short len, 
-		     unsigned char comm, unsigned short addr, unsigned char *info_frame) {
+static void long_comm_create(unsigned char *write_frame, unsigned short len,
+		     unsigned char comm, unsigned short addr, uint32_t start, uint32_t end) {
 	unsigned short crc16;
-	unsigned long start,end;
-	unsigned long index_len;
 
 	write_frame[0] = 0x52;          	// header low
 	write_frame[1] = 0x42;          	// header high
@@ -394,18 +606,15 @@ static int long_comm_create(unsigned char *write_frame, unsigned short len,
 	write_frame[4] = comm;          	// Payload : Read command
 	write_frame[5] = addr & 0x00ff; 	// Payload : address low
 	write_frame[6] = addr>> 8;      	// Payload : address high
-	write_frame[7] = info_frame[11];        // start memory index
-	write_frame[8] = info_frame[12];        // start memory index
-	write_frame[9] = info_frame[13];        // start memory index
-	write_frame[10] = info_frame[14];       // start memory index
-	end = info_frame[7] | (info_frame[8] << 8) | (info_frame[9] << 16) | (info_frame[10] << 24);
-        start = info_frame[11] | (info_frame[12] << 8) | (info_frame[13] << 16) | (info_frame[14] << 24);
-	index_len = ((end - start) + 1) * LEN_R_MEMDATA_ONE;
-	write_frame[11] = info_frame[7];
-	write_frame[12] = info_frame[8];
-	write_frame[13] = info_frame[9];
-	write_frame[14] = info_frame[10];
-	crc16 = crc16_bit_calc(write_frame,LEN_W_MEMDATA-2);
+	write_frame[7] = start & 0xff;          // start memory index
+	write_frame[8] = (start >> 8) & 0xff;   // start memory index
+	write_frame[9] = (start >> 16) & 0xff;  // start memory index
+	write_frame[10] = (start >> 24) & 0xff; // start memory index
+	write_frame[11] = end & 0xff;           // end memory index
+	write_frame[12] = (end >> 8) & 0xff;    // end memory index
+	write_frame[13] = (end >> 16) & 0xff;   // end memory index
+	write_frame[14] = (end >> 24) & 0xff;   // end memory index
+	crc16 = crc16_calc(write_frame,LEN_W_MEMDATA-2);
 	write_frame[15] = crc16 & 0x00ff;
 	write_frame[16] = crc16 >> 8;
 
@@ -413,86 +622,502 @@ static int long_comm_create(unsigned char *write_frame, unsigned short len,
 	printf("in long_comm_create()\n");
 	dump_buff(write_frame, LEN_W_MEMDATA);
 #endif
+}
+
+/*
+ * memory index of a memory data record
+ */
+static uint32_t frame_memory_index(uint8_t *frame) {
+	return frame[7] | (frame[8] << 8) | (frame[9] << 16) | ((uint32_t)frame[10] << 24);
+}
+
+/*
+ * last memory index asked for by a memory data request
+ */
+static uint32_t request_last_index(struct cmd_entry *e) {
+	return e->frame[11] | (e->frame[12] << 8) | (e->frame[13] << 16) | ((uint32_t)e->frame[14] << 24);
+}
+
+/*
+ * drain a broken memory data window
+ * A record went missing (crc error), the rest of the window, and of a
+ * window requested after it, is still on its way. It is read and dropped
+ * up to win_end, the last record requested, so it is not taken for the
+ * answer to the next request.
+ */
+static int drain_window(struct frame_reader *fr, uint8_t *frame, size_t len, uint32_t win_end,
+			long timeout_ms) {
+	int ret = FRAME_READY;
+
+	while (len != LEN_R_MEMDATA_ONE || frame_memory_index(frame) != win_end) {
+		frame_reader_arm(fr, timeout_ms);
+		ret = frame_reader_wait(fr, &frame, &len);
+		if (ret != FRAME_READY) {
+			return ret;
+		}
+	}
+	return ret;
+}
+
+/*
+ * load high-water mark
+ * Returns 1 and sets *index when the state file holds the last memory
+ * index written by a previous run, 0 when there is none.
+ */
+static int load_memory_state(const char *state_path, uint32_t *index) {
+	FILE *fp;
+	unsigned long value;
+	int ret;
+
+	fp = fopen(state_path, "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	ret = fscanf(fp, "%lu", &value);
+	fclose(fp);
+	if (ret != 1) {
+		fprintf(stderr, "state file %s is broken, ignored.\n", state_path);
+		return 0;
+	}
+	*index = (uint32_t)value;
+	return 1;
+}
+
+/*
+ * sync a file to disk
+ * A pipe or a terminal has nothing to sync and passes.
+ */
+static int sync_fd(int fd) {
+	if (fsync(fd) < 0 && errno != EINVAL && errno != ENOTSUP) {
+		perror("fsync");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * sync the directory holding path, so a rename in it is on disk
+ */
+static int sync_dir(const char *path) {
+	char dir_path[PATH_MAX];
+	int fd, ret;
+
+	snprintf(dir_path, sizeof(dir_path), "%s", path);
+	fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		perror("state directory");
+		return -1;
+	}
+	ret = sync_fd(fd);
+	close(fd);
+	return ret;
+}
+
+/*
+ * save high-water mark
+ * Written to a temporary file, synced and renamed, so a crash leaves
+ * either the old or the new index behind, never a half written one.
+ */
+static int save_memory_state(const char *state_path, uint32_t index) {
+	char tmp_path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_path);
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL) {
+		perror("state file");
+		return -1;
+	}
+	fprintf(fp, "%lu\n", (unsigned long)index);
+	if (fflush(fp) || sync_fd(fileno(fp)) < 0) {
+		fprintf(stderr, "state file %s not written.\n", tmp_path);
+		fclose(fp);
+		unlink(tmp_path);
+		return -1;
+	}
+	if (fclose(fp)) {
+		perror("state file");
+		unlink(tmp_path);
+		return -1;
+	}
+	if (rename(tmp_path, state_path) < 0) {
+		perror("state file");
+		unlink(tmp_path);
+		return -1;
+	}
+	if (sync_dir(state_path) < 0) {
+		fprintf(stderr, "state file %s not synced.\n", state_path);
+		return -1;
+	}
+	return 0;
+}
 
-	return (int)index_len;
+/*
+ * memory data pipeline
+ * The calling thread reads the serial link, a decoder thread turns each
+ * window into a column batch and a writer thread formats and writes it,
+ * so formatting and disk writes overlap with the transfer. The stages
+ * hand windows over through SPSC rings in order.
+ */
+
+// raw responses of one window, reader -> decoder
+struct memdata_window {
+	uint32_t first;
+	uint32_t count;
+	uint8_t frames[MEMDATA_WINDOW * LEN_R_MEMDATA_ONE];
+};
+
+// decoded window, decoder -> writer
+struct memdata_decoded {
+	uint32_t first;
+	struct sensor_batch batch;
+};
+
+struct memdata_pipe {
+	struct spsc_ring raw;
+	struct spsc_ring decoded;
+	struct data_writer *writer;
+	const char *tag;
+	const char *state_path;
+	uint16_t device_id;
+	int error;		// set by the writer before it gives up
+};
+
+/*
+ * decoder stage
+ */
+static void *memdata_decoder(void *arg) {
+	struct memdata_pipe *pipe = arg;
+	struct memdata_window *w;
+	struct memdata_decoded *d;
+	uint64_t start_ns;
+
+	while ((w = spsc_ring_read_slot(&pipe->raw)) != NULL) {
+		d = spsc_ring_write_slot(&pipe->decoded);
+		if (d == NULL) {
+			break;
+		}
+		d->first = w->first;
+		d->batch.device_id = pipe->device_id;
+		d->batch.flags = SAMPLE_FLAG_MEMORY;
+		start_ns = stats_now_ns();
+		sensor_batch_decode(&d->batch, w->frames, w->count);
+		stats_histogram_add(&pipeline_stats.decode_ns, stats_now_ns() - start_ns);
+		spsc_ring_commit(&pipe->decoded);
+		spsc_ring_release(&pipe->raw);
+	}
+
+	// end of input, or the writer stopped and the reader has to as well
+	spsc_ring_close(&pipe->decoded);
+	spsc_ring_close(&pipe->raw);
+	return NULL;
+}
+
+/*
+ * writer stage
+ * Every window is flushed and synced before the high-water mark moves
+ * past it, so the mark never runs ahead of the data on disk.
+ */
+static void *memdata_writer(void *arg) {
+	struct memdata_pipe *pipe = arg;
+	struct memdata_decoded *d;
+	uint64_t start_ns;
+
+	while ((d = spsc_ring_read_slot(&pipe->decoded)) != NULL) {
+		start_ns = stats_now_ns();
+		usb_batch_output(pipe->writer, pipe->tag, &d->batch);
+		output_batch_sink_publish(&d->batch);
+		if (data_writer_flush(pipe->writer) ||
+		    (pipe->state_path != NULL &&
+		     (sync_fd(fileno(pipe->writer->fp)) < 0 ||
+		      save_memory_state(pipe->state_path, d->first + d->batch.count - 1)))) {
+			pipe->error = 1;
+			spsc_ring_close(&pipe->decoded);
+			break;
+		}
+		stats_histogram_add(&pipeline_stats.write_ns, stats_now_ns() - start_ns);
+		spsc_ring_release(&pipe->decoded);
+	}
+	return NULL;
+}
+
+/*
+ * start decoder and writer
+ * Signals stay with the calling thread, it is the one waiting in poll().
+ */
+static int memdata_pipe_start(struct memdata_pipe *pipe, pthread_t *threads) {
+	sigset_t all, old;
+	int ret;
+
+	if (spsc_ring_init(&pipe->raw, MEMDATA_PIPE_SLOTS, sizeof(struct memdata_window))) {
+		return -1;
+	}
+	if (spsc_ring_init(&pipe->decoded, MEMDATA_PIPE_SLOTS, sizeof(struct memdata_decoded))) {
+		spsc_ring_free(&pipe->raw);
+		return -1;
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&threads[0], NULL, memdata_decoder, pipe);
+	if (ret == 0) {
+		ret = pthread_create(&threads[1], NULL, memdata_writer, pipe);
+		if (ret != 0) {
+			spsc_ring_close(&pipe->raw);
+			pthread_join(threads[0], NULL);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		spsc_ring_free(&pipe->decoded);
+		spsc_ring_free(&pipe->raw);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * end of input, wait for the last window to be written
+ */
+static int memdata_pipe_finish(struct memdata_pipe *pipe, pthread_t *threads) {
+	spsc_ring_close(&pipe->raw);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	spsc_ring_free(&pipe->decoded);
+	spsc_ring_free(&pipe->raw);
+	return pipe->error ? -1 : 0;
 }
 
 /*
  * get memory data
+ * The index range is requested in windows of MEMDATA_WINDOW records that
+ * pass through the pipeline above, so memory use does not depend on how
+ * many records the sensor holds. The window requests go through the
+ * command queue, the next one is on the wire a round trip before the
+ * current one is complete and the records follow each other without a
+ * gap. A window that breaks rarely has another one behind it to drop.
  */
-int get_memory_data(int fd, const char *csv_path) {
+int get_memory_data(struct sensor_device *dev, const char *csv_path, const char *state_path) {
+	struct frame_reader *fr = &dev->reader;
+	struct cmd_queue *q = &dev->cmds;
+	struct link_stats *ls = &dev->stats;
+	struct link_retry *lr = &dev->retry;
+	struct cmd_entry *e;
 	static unsigned char write_frame[20];
-	static unsigned char info_frame[LEN_R_MEMINFO];
-	static unsigned char *read_frame;
-	static unsigned char *frame_point;
-	unsigned short crc16, checkcrc;
+	unsigned char *info_frame;
+	unsigned char *read_frame;
+	size_t read_len;
+	int wait_ret = FRAME_READY;
+	int retry = 0;
+	uint32_t start, end, limit, win_end, index, req, first = 0, last, lead;
+	uint64_t start_ns;
+	int incremental = 0;
 	int ret = 0;
-	int read_len;
+	static struct data_writer writer;
+	struct memdata_pipe pipe;
+	struct memdata_window *window;
+	pthread_t threads[2];
 	FILE *output_file;
 
 	// get memory information
 	short_comm_create(write_frame, INFO_LEN, CMD_READ, INFO_ADDR);
 
-	ret = communicate_command(fd, write_frame, LEN_W_MEMINFO, info_frame, LEN_R_MEMINFO);
+	start_ns = stats_now_ns();
+	ret = communicate_command(dev, write_frame, LEN_W_MEMINFO, &info_frame, &read_len);
 	if (ret) {
-		printf("command communication failed.\n");
-		ret = -1;
-		goto exit_free;
+		fprintf(stderr, "command communication failed.\n");
+		return -1;
 	}
 #ifdef DEBUG
 	printf("in get_memory_data() after short_comm_create() and communicate_command()\n");
-	dump_buff(info_frame, LEN_R_MEMINFO);
+	dump_buff(info_frame, read_len);
 #endif
+	if (read_len != LEN_R_MEMINFO) {
+		fprintf(stderr, "unexpected response length %zu.\n", read_len);
+		return -1;
+	}
+
+	// records sent during a round trip of the link, the next window
+	// request is due that early to follow without a gap
+	lead = (stats_now_ns() - start_ns) / 1000 / MEMDATA_RECORD_US + 1;
+	if (lead >= MEMDATA_WINDOW) {
+		lead = MEMDATA_WINDOW - 1;
+	}
 
-	read_len = long_comm_create(write_frame, MEMORY_LEN, CMD_READ, MEMORY_ADDR, info_frame);
-	read_frame = (unsigned char *)malloc(read_len);
-	frame_point = read_frame;
+	// latest memory index, oldest memory index
+	end = info_frame[7] | (info_frame[8] << 8) | (info_frame[9] << 16) | ((uint32_t)info_frame[10] << 24);
+	start = info_frame[11] | (info_frame[12] << 8) | (info_frame[13] << 16) | ((uint32_t)info_frame[14] << 24);
 
-	communicate_command(fd, write_frame, LEN_W_MEMDATA, read_frame, read_len);
+	// only the tail newer than the previous run. A mark beyond the latest
+	// index means the device memory was cleared, so everything is fetched.
+	if (state_path != NULL && load_memory_state(state_path, &last)) {
+		incremental = 1;
+		if (last == end) {
 #ifdef DEBUG
-	printf("in get_memory_data() after long_comm_create() and communicate_command()\n");	
-	dump_buff(read_frame, LEN_R_MEMDATA_ONE);
+			fprintf(stderr, "no new memory data.\n");
 #endif
+			return 0;
+		}
+		if (last < end && last >= start) {
+			start = last + 1;
+		}
+	}
 
 	if (csv_path != NULL) {
-		output_file = fopen(csv_path, "w");
+		output_file = fopen(csv_path, incremental ? "a+" : "w");
 	} else {
 		output_file = stdout;
 	}
 	if (output_file == NULL) {
-		printf("output file open failed.");
-		ret = -1;
-		goto exit_free;
+		fprintf(stderr, "output file open failed.\n");
+		return -1;
 	}
 
+	data_writer_init(&writer, output_file);
+
+	// appended runs add the header only to a new file, and only to one
+	// laid out like the records of this run
+	if (incremental && csv_path != NULL) {
+		fseek(output_file, 0, SEEK_END);
+		if (ftell(output_file) == 0) {
+			header_output(&writer, dev->tag != NULL);
+		} else if (!header_match(&writer, dev->tag != NULL)) {
+			fprintf(stderr, "%s has another format or fields, not appended.\n", csv_path);
+			fclose(output_file);
+			return -1;
+		}
+	} else {
+		header_output(&writer, dev->tag != NULL);
+	}
 
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.writer = &writer;
+	pipe.tag = dev->tag;
+	pipe.state_path = state_path;
+	pipe.device_id = dev->id;
+	if (memdata_pipe_start(&pipe, threads)) {
+		ret = -1;
+		goto exit_close;
+	}
 
-	header_output(output_file);
+	// standard output shows only the first MEMDATA_STDOUT_MAX records
+	limit = end;
+	if (csv_path == NULL && start <= end && end - start >= MEMDATA_STDOUT_MAX) {
+		limit = start + MEMDATA_STDOUT_MAX - 1;
+	}
 
-	
-	for (int i = 0; i < read_len / LEN_R_MEMDATA_ONE; i++) {
-		// crc16 check
-		crc16 = crc16_bit_calc(read_frame, LEN_R_MEMDATA_ONE - 2);
-		checkcrc = read_frame[LEN_R_MEMDATA_ONE - 1] << 8 | read_frame[LEN_R_MEMDATA_ONE - 2];
-		if (crc16 != checkcrc) {
-			printf("crc16 check failed.\n");
+	cmd_queue_init(q);
+	window = NULL;
+	index = start;
+	req = start;
+	while (index <= limit) {
+		// windows are queued ahead, the next goes out lead records before
+		// the one streaming in ends
+		while (req <= limit && (e = cmd_queue_add(q, LEN_W_MEMDATA, 0)) != NULL) {
+			win_end = limit;
+			if (limit - req >= MEMDATA_WINDOW) {
+				win_end = req + MEMDATA_WINDOW - 1;
+			}
+			long_comm_create(e->frame, MEMORY_LEN, CMD_READ, MEMORY_ADDR, req, win_end);
+			e->responses = win_end - req + 1;
+			req = win_end + 1;
+		}
+		e = cmd_queue_head(q);
+		if (send_queued(dev, e != NULL && e->responses - e->received <= lead)) {
+			fprintf(stderr, "command communication failed.\n");
 			ret = -1;
-			goto exit_close;
+			break;
 		}
-		// The data existing in the response is from the 19th address.
-		data_analyses(output_file, read_frame + 19);
-		read_frame = read_frame + LEN_R_MEMDATA_ONE;
-		if (csv_path == NULL && i >= 100) {
-			printf("data output stop.\n");
+
+		if (window == NULL) {
+			window = spsc_ring_write_slot(&pipe.raw);
+			if (window == NULL) {
+				// writer failed
+				ret = -1;
+				break;
+			}
+			first = index;
+		}
+
+		frame_reader_arm(fr, link_retry_timeout_ms(lr, retry));
+		wait_ret = frame_reader_wait(fr, &read_frame, &read_len);
+		if (wait_ret == FRAME_READY) {
+			e = cmd_queue_answer(q, read_frame);
+			if (e == NULL) {
+				continue;
+			}
+			if (read_len == LEN_R_MEMDATA_ONE && frame_memory_index(read_frame) == index) {
+				if (e->received == 1) {
+					stats_histogram_add(&ls->rtt_us, (stats_now_ns() - e->sent_ns) / 1000);
+					link_retry_rtt(lr, (stats_now_ns() - e->sent_ns) / 1000);
+				}
+
+				// validated records are gathered back to back and decoded as one batch
+				memcpy(window->frames + (index - first) * LEN_R_MEMDATA_ONE, read_frame, LEN_R_MEMDATA_ONE);
+				index++;
+				if (e->received == e->responses) {
+					window->first = first;
+					window->count = index - first;
+					spsc_ring_commit(&pipe.raw);
+					window = NULL;
+					stats_link_command(ls, retry + 1, 1);
+					link_retry_result(lr, 1, dev->name);
+					retry = 0;
+				}
+				continue;
+			}
+			if (read_frame[4] & 0x80) {
+				fprintf(stderr, "device error response. code %02x\n", read_frame[7]);
+				ls->error_responses++;
+			} else {
+				fprintf(stderr, "unexpected memory record.\n");
+			}
+		} else if (wait_ret == FRAME_TIMEOUT) {
+			ls->timeouts++;
+		}
+
+		// the transfer broke off. Records in hand are kept, what is still
+		// on its way is drained and the rest is requested again.
+		if (index != first) {
+			window->first = first;
+			window->count = index - first;
+			spsc_ring_commit(&pipe.raw);
+			window = NULL;
+			retry = 0;
+		}
+		if (wait_ret == FRAME_ERROR || terminated || ++retry >= MAX_RETRY) {
+			fprintf(stderr, "memory data read failed.\n");
+			stats_link_command(ls, retry, 0);
+			link_retry_result(lr, 0, dev->name);
+			ret = -1;
 			break;
 		}
+		e = cmd_queue_last_sent(q);
+		if (wait_ret == FRAME_READY && e != NULL) {
+			wait_ret = drain_window(fr, read_frame, read_len, request_last_index(e),
+						link_retry_timeout_ms(lr, 0));
+		}
+		if (wait_ret == FRAME_TIMEOUT) {
+			frame_reader_poll(NULL, 0, link_retry_backoff_ms(lr, retry));
+		}
+		frame_reader_reset(fr);
+		cmd_queue_init(q);
+		req = index;
+	}
+	if (csv_path == NULL && limit != end && index > limit) {
+		fprintf(stderr, "data output stop.\n");
+	}
+
+	if (memdata_pipe_finish(&pipe, threads)) {
+		ret = -1;
 	}
 
 exit_close:
+	data_writer_flush(&writer);
 	if (csv_path != NULL) {
 		fclose(output_file);
 	}
-exit_free:
-	free(frame_point);
 	return ret;
 }
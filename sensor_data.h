@@ -19,10 +19,22 @@
 #ifndef __SENSOR_DATA__
 #define __SENSOR_DATA__
 
+#include <stdint.h>
+
+#include "common.h"
+
+struct sensor_device;
+
 int install_sig_handler(void);
 
-int get_latest_data(int fd, char *csv_path);
+int is_terminated(void);
+
+void sensor_raw_decode(struct sensor_raw_t *raw, const uint8_t *buf);
+
+void latest_status_set(int enable);
+
+int get_latest_data(struct sensor_device *devs, int count, const char *csv_path);
 
-int get_memory_data(int fd, char *csv_data);
+int get_memory_data(struct sensor_device *dev, const char *csv_path, const char *state_path);
 
 #endif /* __SENSOR_DATA__ */
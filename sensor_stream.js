@@ -0,0 +1,55 @@
+// sensor_stream.js
+// One EventSource on /events shared by every chart frame.
+// The frameset page (2jcie.html) loads this file as well, the chart
+// frames then subscribe through window.parent so the collector sees a
+// single connection no matter how many charts are shown.
+
+var sensorListeners = [];
+var sensorSource = null;
+
+// subscribe fn(sample) to the stream of this window
+function sensorSubscribe(fn) {
+    sensorListeners.push(fn);
+    if (sensorSource !== null) {
+        return;
+    }
+    sensorSource = new EventSource('/events');
+    sensorSource.onmessage = function(ev) {
+        var sample = JSON.parse(ev.data);
+        for (var i = 0; i < sensorListeners.length; ++i) {
+            sensorListeners[i](sample);
+        }
+    };
+}
+
+// subscribe through the frameset page when there is one
+function sensorStream(fn) {
+    try {
+        if (window.parent !== window && window.parent.sensorSubscribe) {
+            window.parent.sensorSubscribe(fn);
+            return;
+        }
+    } catch (e) {
+        // other origin, fall back to an own connection
+    }
+    sensorSubscribe(fn);
+}
+
+// push field of device (id, default 0) into every dataset of chart
+function attachSensorStream(chart, field, device) {
+    if (device === undefined) {
+        device = 0;
+    }
+    sensorStream(function(sample) {
+        if (sample.id !== device) {
+            return;
+        }
+        chart.data.datasets.forEach(function(dataset) {
+            dataset.data.push({
+                x: sample.time,
+                y: sample[field]
+            });
+        });
+        chart.update({ preservation: true });
+    });
+}
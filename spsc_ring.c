@@ -0,0 +1,137 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "spsc_ring.h"
+
+/*
+ * sleep until seq moves away from value
+ */
+static void ring_wait(struct spsc_ring *r, uint32_t value) {
+	syscall(SYS_futex, (uint32_t *)&r->seq, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/*
+ * advance seq and wake the other side
+ */
+static void ring_wake(struct spsc_ring *r) {
+	atomic_fetch_add_explicit(&r->seq, 1, memory_order_release);
+	syscall(SYS_futex, (uint32_t *)&r->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * ring init, count must be a power of two
+ */
+int spsc_ring_init(struct spsc_ring *r, uint32_t count, size_t slot_size) {
+	if (count == 0 || (count & (count - 1)) != 0) {
+		fprintf(stderr, "ring slot count must be a power of two.\n");
+		return -1;
+	}
+	r->slots = malloc(count * slot_size);
+	if (r->slots == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	r->slot_size = slot_size;
+	r->count = count;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->closed, 0);
+	atomic_init(&r->seq, 0);
+	return 0;
+}
+
+void spsc_ring_free(struct spsc_ring *r) {
+	free(r->slots);
+	r->slots = NULL;
+}
+
+/*
+ * producer: next free slot, NULL once the ring is closed
+ */
+void *spsc_ring_write_slot(struct spsc_ring *r) {
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail, seq;
+
+	for (;;) {
+		seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+		if (atomic_load_explicit(&r->closed, memory_order_acquire)) {
+			return NULL;
+		}
+		tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (head - tail < r->count) {
+			return r->slots + (head & (r->count - 1)) * r->slot_size;
+		}
+		ring_wait(r, seq);
+	}
+}
+
+/*
+ * producer: hand the slot from spsc_ring_write_slot() to the consumer
+ */
+void spsc_ring_commit(struct spsc_ring *r) {
+	atomic_fetch_add_explicit(&r->head, 1, memory_order_release);
+	ring_wake(r);
+}
+
+/*
+ * consumer: oldest committed slot, NULL when closed and drained
+ */
+void *spsc_ring_read_slot(struct spsc_ring *r) {
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head, seq;
+
+	for (;;) {
+		seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		if (head != tail) {
+			return r->slots + (tail & (r->count - 1)) * r->slot_size;
+		}
+		if (atomic_load_explicit(&r->closed, memory_order_acquire)) {
+			return NULL;
+		}
+		ring_wait(r, seq);
+	}
+}
+
+/*
+ * consumer: give the slot from spsc_ring_read_slot() back
+ */
+void spsc_ring_release(struct spsc_ring *r) {
+	atomic_fetch_add_explicit(&r->tail, 1, memory_order_release);
+	ring_wake(r);
+}
+
+/*
+ * no more slots either way
+ * The consumer still drains what was committed, the producer gets NULL.
+ * Either side may close, the other one is woken up.
+ */
+void spsc_ring_close(struct spsc_ring *r) {
+	atomic_store_explicit(&r->closed, 1, memory_order_release);
+	ring_wake(r);
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __SPSC_RING__
+#define __SPSC_RING__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * single producer / single consumer ring of fixed size slots
+ * The slots are filled in place, only the head and tail counters are
+ * shared. A side that finds the ring full or empty sleeps with futex(2)
+ * on seq, which every commit, release and close advances.
+ */
+struct spsc_ring {
+	uint8_t *slots;
+	size_t slot_size;
+	uint32_t count;			// power of two
+	_Atomic uint32_t head;		// slots ever committed by the producer
+	_Atomic uint32_t tail;		// slots ever released by the consumer
+	_Atomic uint32_t closed;
+	_Atomic uint32_t seq;		// futex word, changes on every ring event
+};
+
+int spsc_ring_init(struct spsc_ring *r, uint32_t count, size_t slot_size);
+
+void spsc_ring_free(struct spsc_ring *r);
+
+void *spsc_ring_write_slot(struct spsc_ring *r);
+
+void spsc_ring_commit(struct spsc_ring *r);
+
+void *spsc_ring_read_slot(struct spsc_ring *r);
+
+void spsc_ring_release(struct spsc_ring *r);
+
+void spsc_ring_close(struct spsc_ring *r);
+
+#endif /* __SPSC_RING__ */
@@ -0,0 +1,173 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "device.h"
+#include "stats.h"
+
+struct pipeline_stats pipeline_stats;
+
+static const double percentiles[] = { 50, 90, 99, 99.9 };
+static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+
+uint64_t stats_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t value) {
+	int e;
+
+	if (value < STATS_SUB_BUCKETS) {
+		return (int)value;
+	}
+	e = 63 - __builtin_clzll(value);
+	if (e >= STATS_MAX_EXP) {
+		return STATS_BUCKETS - 1;
+	}
+	return (e - 3) * STATS_SUB_BUCKETS + (int)(value >> (e - 4)) - STATS_SUB_BUCKETS;
+}
+
+/*
+ * highest value that lands in bucket i
+ */
+static uint64_t bucket_upper(int i) {
+	int e, sub;
+
+	if (i < STATS_SUB_BUCKETS) {
+		return i;
+	}
+	e = i / STATS_SUB_BUCKETS + 3;
+	sub = i % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+	return ((uint64_t)(sub + 1) << (e - 4)) - 1;
+}
+
+void stats_histogram_add(struct stats_histogram *h, uint64_t value) {
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&h->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&h->max, &max, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		;
+	}
+}
+
+/*
+ * value at percentile (0-100), the bucket upper bound capped at max
+ */
+uint64_t stats_histogram_percentile(const struct stats_histogram *h, double percentile) {
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	uint64_t target, seen = 0, upper;
+	int i;
+
+	if (count == 0) {
+		return 0;
+	}
+	target = (uint64_t)(percentile / 100 * count + 0.999999);
+	if (target == 0) {
+		target = 1;
+	}
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target) {
+			upper = bucket_upper(i);
+			return upper < max ? upper : max;
+		}
+	}
+	return max;
+}
+
+/*
+ * one finished command of a link
+ * attempts is the number of times it was sent, ok whether it was answered.
+ */
+void stats_link_command(struct link_stats *ls, int attempts, int ok) {
+	ls->commands++;
+	if (!ok) {
+		ls->failures++;
+		return;
+	}
+	if (attempts > STATS_MAX_ATTEMPTS) {
+		attempts = STATS_MAX_ATTEMPTS;
+	}
+	if (attempts > 0) {
+		ls->attempts[attempts - 1]++;
+	}
+}
+
+void stats_histogram_json(FILE *fp, const struct stats_histogram *h) {
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	uint64_t sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	size_t i;
+
+	fprintf(fp, "{\"count\":%" PRIu64 ",\"mean\":%" PRIu64, count, count ? sum / count : 0);
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		fprintf(fp, ",\"%s\":%" PRIu64, percentile_names[i], stats_histogram_percentile(h, percentiles[i]));
+	}
+	fprintf(fp, ",\"max\":%" PRIu64 "}", __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+}
+
+/*
+ * every counter as one JSON object
+ */
+void stats_json(FILE *fp, struct sensor_device *devs, int count) {
+	struct link_stats *ls;
+	struct frame_reader *fr;
+	int i, n, last;
+
+	fprintf(fp, "{\"devices\":[");
+	for (i = 0; i < count; i++) {
+		ls = &devs[i].stats;
+		fr = &devs[i].reader;
+		fprintf(fp, "%s{\"device\":\"%s\",\"id\":%d,\"commands\":%" PRIu64 ",\"failures\":%" PRIu64
+			",\"timeouts\":%" PRIu64 ",\"error_responses\":%" PRIu64 ",\"attempts\":[",
+			i ? "," : "", devs[i].label, devs[i].id, ls->commands, ls->failures,
+			ls->timeouts, ls->error_responses);
+		// trailing zero counts are left out
+		for (last = STATS_MAX_ATTEMPTS - 1; last > 0 && ls->attempts[last] == 0; last--) {
+			;
+		}
+		for (n = 0; n <= last; n++) {
+			fprintf(fp, "%s%" PRIu64, n ? "," : "", ls->attempts[n]);
+		}
+		fprintf(fp, "],\"bytes_read\":%" PRIu64 ",\"frames\":%" PRIu64 ",\"crc_errors\":%lu"
+			",\"discarded\":%lu,\"timeout_ms\":%ld,\"degraded\":%s,\"status\":%d,\"table\":\"%s\",\"rtt_us\":",
+			fr->bytes_read, fr->frames, fr->crc_errors, fr->discarded,
+			devs[i].retry.timeout_ms, devs[i].retry.degraded ? "true" : "false",
+			devs[i].status, devs[i].table->name);
+		stats_histogram_json(fp, &ls->rtt_us);
+		fputc('}', fp);
+	}
+	fprintf(fp, "],\"decode_ns\":");
+	stats_histogram_json(fp, &pipeline_stats.decode_ns);
+	fprintf(fp, ",\"write_ns\":");
+	stats_histogram_json(fp, &pipeline_stats.write_ns);
+	fputc('}', fp);
+}
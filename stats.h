@@ -0,0 +1,80 @@
+/*
+ * This file is provided under a Simplified BSD License.
+ *
+ * Copyright (C) 2019 Atmark Techno, Inc. All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_SUB_BUCKETS	(16)	// per power of two, about 6% resolution
+#define STATS_MAX_EXP		(40)	// values up to 2^40
+#define STATS_BUCKETS		((STATS_MAX_EXP - 3) * STATS_SUB_BUCKETS)
+#define STATS_MAX_ATTEMPTS	(16)	// attempts per command counted one by one
+
+struct sensor_device;
+
+/*
+ * latency histogram
+ * Log-linear buckets as in HdrHistogram: values below STATS_SUB_BUCKETS
+ * are exact, above that every power of two is split in STATS_SUB_BUCKETS.
+ * Updated with relaxed atomics, so any thread may add and read.
+ */
+struct stats_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[STATS_BUCKETS];
+};
+
+/*
+ * command round trips of one serial link
+ * attempts[n] counts commands answered after n re-sends.
+ */
+struct link_stats {
+	uint64_t commands;
+	uint64_t timeouts;
+	uint64_t error_responses;
+	uint64_t failures;		// commands given up after every attempt
+	uint64_t attempts[STATS_MAX_ATTEMPTS];
+	struct stats_histogram rtt_us;	// request sent to response frame
+};
+
+/*
+ * memory data pipeline, all devices
+ */
+struct pipeline_stats {
+	struct stats_histogram decode_ns;	// Table84 decode of one window
+	struct stats_histogram write_ns;	// output and flush of one window or poll
+};
+
+extern struct pipeline_stats pipeline_stats;
+
+uint64_t stats_now_ns(void);
+
+void stats_histogram_add(struct stats_histogram *h, uint64_t value);
+
+uint64_t stats_histogram_percentile(const struct stats_histogram *h, double percentile);
+
+void stats_link_command(struct link_stats *ls, int attempts, int ok);
+
+void stats_histogram_json(FILE *fp, const struct stats_histogram *h);
+
+void stats_json(FILE *fp, struct sensor_device *devs, int count);
+
+#endif /* __STATS__ */